@@ -2,54 +2,537 @@
 #include "sql_class.h"           // SSV
 #include "ha_gatherdb.h"
 #include "mysql.h"
+#include "errmsg.h"
 #include "sql_select.h"
 
+static uchar* backend_get_key(connect_pool *pool, size_t *length,
+                             my_bool not_used __attribute__((unused)))
+{
+	*length=pool->key_length;
+	return (uchar*) pool->key;
+}
+
 int connpool::init()
 {
 	DBUG_ENTER("connpool::init");
 	instances_count=0;
-	instancepool = new connect_pool();
-	pools = new connect_pool();
+	min_connections=MIN_CONNECTIONS;
+	max_connections=MAX_CONNECTIONS;
+	pools=0;
+	connect_timeout=MYDB_CONNECT_TIMEOUT;
+	warmup_connections=MIN_CONNECTIONS;
+	warmup_tasks=0;
+	warmup_count=warmup_next=warmup_running=0;
+	maintenance_running=false;
+	stopping=false;
+	mysql_mutex_init(key_mutex_connpool, &mutex, MY_MUTEX_INIT_FAST);
+	mysql_cond_init(key_cond_connpool, &cond, NULL);
+	mysql_cond_init(key_cond_connpool_warmup, &warmup_cond, NULL);
+	mysql_rwlock_init(key_rwlock_gatherdb_backends, &backends_lock);
+	(void) my_hash_init(&backends,&my_charset_bin,32,0,0,
+	                    (my_hash_get_key) backend_get_key,0,HASH_UNIQUE);
+	/* routing works whether or not gather.ini lists any shard backend */
+	if(add_route_backend(&sharding_instance_param))
+		DBUG_RETURN(1);
 	DBUG_RETURN(0);
 }
 
-MYSQL_CONNECT *connpool::fetchone(MYSQL_INSTANCE *instance)
+static uint make_backend_key(char *key,const char *server,uint sport,const char *schema)
 {
-	DBUG_ENTER("connpool::fetchone");
-	//
-	instancepool=pools;
-	int idx1=0;
+	return (uint) my_snprintf(key,MYDB_BACKEND_KEY_LENGTH,"%s:%u/%s",
+		server,sport,schema?schema:"");
+}
+
+/*
+  Backends are only ever added, never removed, until dispose(), so a
+  connect_pool pointer stays valid after the registry lock is dropped.
+  Must be called with backends_lock held for writing, or before the pool
+  is shared.
+*/
+int connpool::add_backend(connect_pool *pool)
+{
+	pool->key_length=make_backend_key(pool->key,pool->param->instance->server,
+		pool->param->instance->sport,pool->param->schema);
+	if(my_hash_insert(&backends,(uchar *)pool))
+		return 1;
+	pool->next=pools;
+	pools=pool;
+	instances_count++;
+	return 0;
+}
+
+/*
+  Shard rows in train_map may name a schema that gather.ini does not list.
+  Register it on first use with the credentials of a backend on the same
+  host and port.
+*/
+connect_pool *connpool::register_backend(CONNECT_PARAM *param)
+{
+	char key[MYDB_BACKEND_KEY_LENGTH];
+	uint length=make_backend_key(key,param->instance->server,param->instance->sport,param->schema);
+	connect_pool *pool,*like;
+	mysql_rwlock_wrlock(&backends_lock);
+	if((pool=(connect_pool *)my_hash_search(&backends,(uchar *)key,length)))
+		goto end;
+	for(like=pools;like;like=like->next)
+	{
+		if(like->param->instance->sport==param->instance->sport&&
+			!strcmp(like->param->instance->server,param->instance->server))
+			break;
+	}
+	if(!like)
+		goto end;
+	pool=new connect_pool();
+	pool->param->instance->server=my_strdup(param->instance->server,MYF(0));
+	pool->param->instance->sport=param->instance->sport;
+	pool->param->user=like->param->user;
+	pool->param->password=like->param->password;
+	pool->param->schema=my_strdup(param->schema?param->schema:"",MYF(0));
+	pool->min_connections=like->min_connections;
+	pool->max_connections=like->max_connections;
+	pool->connect_timeout=like->connect_timeout;
+	if(pool->init_connections(min_connections,max_connections)||add_backend(pool))
+	{
+		delete pool;
+		pool=0;
+	}
+end:
+	mysql_rwlock_unlock(&backends_lock);
+	return pool;
+}
+
+connect_pool *connpool::find_backend(CONNECT_PARAM *param)
+{
+	char key[MYDB_BACKEND_KEY_LENGTH];
+	uint length=make_backend_key(key,param->instance->server,param->instance->sport,param->schema);
+	connect_pool *pool;
+	mysql_rwlock_rdlock(&backends_lock);
+	pool=(connect_pool *)my_hash_search(&backends,(uchar *)key,length);
+	mysql_rwlock_unlock(&backends_lock);
+	if(!pool)
+		pool=register_backend(param);
+	return pool;
+}
+
+static inline int32 slot_of(int64 head)
+{
+	return (int32)(head&0xFFFFFFFF)-1;
+}
+
+static inline int64 make_head(int64 old_head,int32 idx)
+{
+	return (int64)(((((ulonglong)old_head>>32)+1)<<32)|(uint32)(idx+1));
+}
+
+MYSQL_CONNECT *connect_pool::pop_slot(int64 volatile *head)
+{
+	int64 old_head=my_atomic_load64(head);
+	int64 new_head;
+	int32 idx;
 	do
 	{
-		idx1++;
-		if(instancepool->param->instance->server==instance->server&&instancepool->param->instance->sport==instance->sport)
+		if((idx=slot_of(old_head))<0) return NULL;
+		new_head=make_head(old_head,my_atomic_load32(&connections[idx].next_free));
+	}while(!my_atomic_cas64(head,&old_head,new_head));
+	return &connections[idx];
+}
+
+void connect_pool::push_slot(int64 volatile *head,MYSQL_CONNECT *connection)
+{
+	int64 old_head=my_atomic_load64(head);
+	int64 new_head;
+	do
+	{
+		my_atomic_store32(&connection->next_free,slot_of(old_head));
+		new_head=make_head(old_head,(int32)(connection-connections));
+	}while(!my_atomic_cas64(head,&old_head,new_head));
+}
+
+int connect_pool::init_connections(uint min,uint max)
+{
+	DBUG_ENTER("connect_pool::init_connections");
+	if(!max_connections) max_connections=max;
+	if(!min_connections) min_connections=min;
+	if(min_connections>max_connections) min_connections=max_connections;
+	if(!(connections=(MYSQL_CONNECT *)my_malloc(max_connections*sizeof(MYSQL_CONNECT),
+		MYF(MY_WME|MY_ZEROFILL))))
+		DBUG_RETURN(1);
+	free_head=empty_head=0;
+	free_length=opened=0;
+	for(uint idx=max_connections;idx>0;idx--)
+	{
+		connections[idx-1].owner=this;
+		push_slot(&empty_head,&connections[idx-1]);
+	}
+	DBUG_RETURN(0);
+}
+
+int connect_pool::open_connection(MYSQL_CONNECT *connection)
+{
+	connection->isused=false;
+	connection->isalive=false;
+	if(!(connection->mysql=mysql_init(NULL)))
+		return 1;
+	if(connect_timeout)
+		mysql_options(connection->mysql,MYSQL_OPT_CONNECT_TIMEOUT,
+			(const char *)&connect_timeout);
+	if(!mysql_real_connect(connection->mysql,
+		param->instance->server,
+		param->user,
+		param->password,
+		param->schema,
+		param->instance->sport,
+		MYSQL_UNIX_ADDR,0))
+	{
+		mysql_close(connection->mysql);
+		connection->mysql=0;
+		return 1;
+	}
+	connection->isalive=true;
+	return 0;
+}
+
+void connect_pool::discard_slot(MYSQL_CONNECT *connection)
+{
+	if(connection->mysql)
+		mysql_close(connection->mysql);
+	connection->mysql=0;
+	connection->isalive=false;
+	connection->isused=false;
+	push_slot(&empty_head,connection);
+}
+
+void connect_pool::close_connection(MYSQL_CONNECT *connection)
+{
+	my_atomic_add32(&opened,-1);
+	discard_slot(connection);
+}
+
+MYSQL_CONNECT *connect_pool::pop_idle()
+{
+	MYSQL_CONNECT *connection;
+	if((connection=pop_slot(&free_head)))
+	{
+		my_atomic_add32(&free_length,-1);
+		connection->isused=true;
+	}
+	return connection;
+}
+
+/*
+  Make a connection available. When sessions are queued it goes straight
+  to the oldest waiter. The waiting check comes after the push, so a
+  waiter that enqueued concurrently finds the connection in its own
+  dispatch().
+*/
+void connect_pool::put_idle(MYSQL_CONNECT *connection)
+{
+	push_slot(&free_head,connection);
+	my_atomic_add32(&free_length,1);
+	if(my_atomic_load32(&waiting))
+	{
+		mysql_mutex_lock(&wait_mutex);
+		dispatch();
+		mysql_mutex_unlock(&wait_mutex);
+	}
+}
+
+/* hand idle connections to queued sessions in FIFO order, wait_mutex held */
+void connect_pool::dispatch()
+{
+	MYSQL_CONNECT *connection;
+	pool_waiter *waiter;
+	bool woken=false;
+	while((waiter=wait_first)&&(connection=pop_idle()))
+	{
+		if(!(wait_first=waiter->next))
+			wait_last=NULL;
+		my_atomic_add32(&waiting,-1);
+		waiter->connection=connection;
+		woken=true;
+	}
+	if(woken)
+		mysql_cond_broadcast(&wait_cond);
+}
+
+/* open a connection on a spare slot, NULL at max_connections or on error */
+MYSQL_CONNECT *connect_pool::grow_one()
+{
+	MYSQL_CONNECT *connection;
+	if(!(connection=pop_slot(&empty_head)))
+		return NULL;
+	if(open_connection(connection))
+	{
+		push_slot(&empty_head,connection);
+		return NULL;
+	}
+	my_atomic_add32(&opened,1);
+	return connection;
+}
+
+/*
+  Checkout. Without queued sessions this is an O(1) pop, or a grow while
+  under max_connections. Otherwise the session joins the FIFO queue and
+  waits up to wait_timeout milliseconds for a released connection. A
+  wait_timeout of 0 fails fast instead.
+*/
+MYSQL_CONNECT *connect_pool::fetchone(ulong wait_timeout)
+{
+	MYSQL_CONNECT *connection;
+	pool_waiter waiter;
+	struct timespec abstime;
+	if(!healthy)
+		return NULL;
+	if(!my_atomic_load32(&waiting))
+	{
+		if((connection=pop_idle()))
+			return connection;
+		if((connection=grow_one()))
 		{
-			for(uint idx=0;idx<MAX_CONNECTIONS;idx++)
+			connection->isused=true;
+			return connection;
+		}
+	}
+	if(!wait_timeout)
+		return NULL;
+	set_timespec_nsec(abstime,(ulonglong)wait_timeout*1000000ULL);
+	waiter.connection=NULL;
+	waiter.next=NULL;
+	mysql_mutex_lock(&wait_mutex);
+	if(wait_last)
+		wait_last->next=&waiter;
+	else
+		wait_first=&waiter;
+	wait_last=&waiter;
+	my_atomic_add32(&waiting,1);
+	dispatch();
+	while(!waiter.connection)
+	{
+		if(mysql_cond_timedwait(&wait_cond,&wait_mutex,&abstime)&&!waiter.connection)
+		{
+			/* timed out while still queued, unlink ourselves */
+			pool_waiter **prev=&wait_first,*last=NULL;
+			while(*prev!=&waiter)
 			{
-				if(instancepool->connections[idx].isalive&&!instancepool->connections[idx].isused)
-				{
-					return &instancepool->connections[idx];
-				}
+				last=*prev;
+				prev=&last->next;
+			}
+			*prev=waiter.next;
+			if(wait_last==&waiter)
+				wait_last=last;
+			my_atomic_add32(&waiting,-1);
+			break;
+		}
+	}
+	mysql_mutex_unlock(&wait_mutex);
+	return waiter.connection;
+}
+
+/* flag a connection whose last call lost the server, for releaseone() */
+void check_alive(MYSQL_CONNECT *connection)
+{
+	if(mysql_errno(connection->mysql)==CR_SERVER_GONE_ERROR||
+		mysql_errno(connection->mysql)==CR_SERVER_LOST)
+		connection->isalive=false;
+}
+
+void connect_pool::releaseone(MYSQL_CONNECT *connection)
+{
+	connection->isused=false;
+	if(!connection->isalive)
+	{
+		close_connection(connection);
+		/* replace it for a queued session rather than let it time out */
+		if(my_atomic_load32(&waiting)&&(connection=grow_one()))
+			put_idle(connection);
+		return;
+	}
+	/* shrink back to min_connections once there are idle spares */
+	if(!my_atomic_load32(&waiting)&&
+		(uint)my_atomic_load32(&free_length)>=min_connections)
+	{
+		int32 count=my_atomic_load32(&opened);
+		while((uint)count>min_connections)
+		{
+			if(my_atomic_cas32(&opened,&count,count-1))
+			{
+				discard_slot(connection);
+				return;
 			}
 		}
-		instancepool=pools->next;
-	}while(idx1<instances_count);
-	//
-	DBUG_RETURN(NULL);
+	}
+	put_idle(connection);
+}
+
+/*
+  Run by the maintenance thread only. Pings every idle connection, drops
+  the dead ones and tops the backend up to min_connections. When no
+  connection to the backend is left it is marked unhealthy and retried
+  with an exponential backoff; while some are, the top-up is retried on
+  the next run.
+*/
+void connect_pool::maintain(time_t now)
+{
+	MYSQL_CONNECT *connection,*chain=NULL;
+	if(!healthy&&now<next_retry)
+		return;
+	/* take all idle connections first, a LIFO pop would hand back the same one */
+	while((connection=pop_slot(&free_head)))
+	{
+		my_atomic_add32(&free_length,-1);
+		connection->next_free=chain?(int32)(chain-connections):-1;
+		chain=connection;
+	}
+	while((connection=chain))
+	{
+		chain=connection->next_free<0?NULL:&connections[connection->next_free];
+		if(mysql_ping(connection->mysql))
+		{
+			close_connection(connection);
+			continue;
+		}
+		put_idle(connection);
+	}
+	if(fill_min()&&!my_atomic_load32(&opened))
+	{
+		next_retry=now+(MYDB_RETRY_MIN_INTERVAL<<fail_count);
+		if(fail_count<MYDB_RETRY_MAX_SHIFT)
+			fail_count++;
+		healthy=false;
+		return;
+	}
+	fail_count=0;
+	healthy=true;
+}
+
+int connect_pool::fill_min()
+{
+	return fill(min_connections);
+}
+
+int connect_pool::fill(uint target)
+{
+	MYSQL_CONNECT *connection;
+	int error=0;
+	while((uint)my_atomic_load32(&opened)<target)
+	{
+		if(!(connection=pop_slot(&empty_head)))
+			break;
+		if(open_connection(connection))
+		{
+			push_slot(&empty_head,connection);
+			error=1;
+			break;
+		}
+		my_atomic_add32(&opened,1);
+		put_idle(connection);
+	}
+	return error;
+}
+
+void connect_pool::dispose()
+{
+	MYSQL_CONNECT *connection;
+	while((connection=pop_slot(&free_head)))
+	{
+		my_atomic_add32(&free_length,-1);
+		close_connection(connection);
+	}
+}
+
+/* open one more idle connection, used by the parallel warm-up */
+int connect_pool::warm_one()
+{
+	MYSQL_CONNECT *connection;
+	if(!(connection=pop_slot(&empty_head)))
+		return 0;
+	if(open_connection(connection))
+	{
+		push_slot(&empty_head,connection);
+		if(!my_atomic_load32(&opened))
+		{
+			next_retry=my_time(0)+MYDB_RETRY_MIN_INTERVAL;
+			healthy=false;
+		}
+		return 1;
+	}
+	my_atomic_add32(&opened,1);
+	put_idle(connection);
+	return 0;
+}
+
+MYSQL_CONNECT *connpool::fetchone(CONNECT_PARAM *param,ulong wait_timeout)
+{
+	DBUG_ENTER("connpool::fetchone");
+	connect_pool *pool=find_backend(param);
+	DBUG_RETURN(pool?pool->fetchone(wait_timeout):NULL);
+}
+
+/*
+  Run one statement on a pooled connection of param's backend and return
+  its stored result, NULL on any failure. Used for the routing metadata.
+*/
+MYSQL_RES *connpool::store_query(CONNECT_PARAM *param,const char *sql,uint length,
+	ulong wait_timeout)
+{
+	MYSQL_CONNECT *connection;
+	MYSQL_RES *result=NULL;
+	if(!(connection=fetchone(param,wait_timeout)))
+		return NULL;
+	if(mysql_real_query(connection->mysql,sql,length))
+		check_alive(connection);
+	else
+		result=mysql_store_result(connection->mysql);
+	releaseone(connection);
+	return result;
+}
+
+/*
+  Interrupt the statement running on connection from another connection
+  of the same backend, so that its result ends early. Only an idle or new
+  connection is used; waiting for one could stall the caller behind its
+  own checked out connections. The caller must read the result to its
+  end before releasing connection, a late KILL then finds the statement
+  done or lands between statements, where the server clears it.
+*/
+int connpool::kill_query(MYSQL_CONNECT *connection,CONNECT_PARAM *param)
+{
+	DBUG_ENTER("connpool::kill_query");
+	MYSQL_CONNECT *killer;
+	char sql[64];
+	int error;
+	if(!(killer=fetchone(param,0)))
+		DBUG_RETURN(1);
+	uint length=(uint) my_snprintf(sql,sizeof(sql),"KILL QUERY %lu",
+		mysql_thread_id(connection->mysql));
+	if((error=mysql_real_query(killer->mysql,sql,length)))
+		check_alive(killer);
+	releaseone(killer);
+	DBUG_RETURN(error);
 }
 
 void connpool::releaseone(MYSQL_CONNECT *connection)
 {
 	DBUG_ENTER("connpool::releaseone");
-	//
-	connection->isused=false;
-	//		
+	connection->owner->releaseone(connection);
+	DBUG_VOID_RETURN;
 }
 
 int connpool::dispose()
 {
 	DBUG_ENTER("connpool::dispose");
-	//ͷŻ
+	mysql_mutex_lock(&mutex);
+	while(warmup_running)
+		mysql_cond_wait(&warmup_cond,&mutex);
+	mysql_mutex_unlock(&mutex);
+	my_free(warmup_tasks);
+	for(connect_pool *pool=pools;pool;pool=pool->next)
+		pool->dispose();
+	my_hash_free(&backends);
+	mysql_rwlock_destroy(&backends_lock);
+	mysql_cond_destroy(&warmup_cond);
+	mysql_cond_destroy(&cond);
+	mysql_mutex_destroy(&mutex);
 	DBUG_RETURN(0);	
 }
 
@@ -70,32 +553,157 @@ int connpool::realiveconnect(MYSQL_CONNECT *connection,CONNECT_PARAM *param)
 	DBUG_RETURN(1);	
 }
 
+/*
+  Backends are only ever pushed on the head of pools, so once the head is
+  read under the lock the rest of the chain can be walked without it.
+*/
+connect_pool *connpool::first_backend()
+{
+	connect_pool *pool;
+	mysql_rwlock_rdlock(&backends_lock);
+	pool=pools;
+	mysql_rwlock_unlock(&backends_lock);
+	return pool;
+}
+
 int connpool::pool_real_connect()
 {
 	DBUG_ENTER("connpool::pool_real_connect");
-	instancepool=pools;
-	int idx1=0;
-	do
+	for(connect_pool *pool=first_backend();pool;pool=pool->next)
+		pool->fill_min();
+	DBUG_RETURN(0);
+}
+
+static void *connpool_maintenance(void *arg)
+{
+	my_thread_init();
+	((connpool *)arg)->maintenance_loop();
+	my_thread_end();
+	pthread_exit(0);
+	return NULL;
+}
+
+void connpool::maintenance_loop()
+{
+	struct timespec abstime;
+	mysql_mutex_lock(&mutex);
+	while(!stopping)
 	{
-		idx1++;
-		for(uint idx=0;idx<MAX_CONNECTIONS;idx++)
-		{
-			if(instancepool->connections[idx].isalive) continue;
-			if(!mysql_real_connect(instancepool->connections[idx].mysql,
-				instancepool->param->instance->server,
-				instancepool->param->user,
-				instancepool->param->password,
-				instancepool->param->schema,
-				instancepool->param->instance->sport,
-				MYSQL_UNIX_ADDR,0))
-			{
-				instancepool->connections[idx].isalive=false;
-				continue;
-			}
-			instancepool->connections[idx].isalive=true;
-		}
-		instancepool=pools->next;
-	}while(idx1<instances_count);
+		mysql_mutex_unlock(&mutex);
+		time_t now=my_time(0);
+		for(connect_pool *pool=first_backend();pool;pool=pool->next)
+			pool->maintain(now);
+		mysql_mutex_lock(&mutex);
+		if(stopping)
+			break;
+		set_timespec(abstime,ping_interval);
+		mysql_cond_timedwait(&cond,&mutex,&abstime);
+	}
+	mysql_mutex_unlock(&mutex);
+}
+
+int connpool::start_maintenance(uint interval)
+{
+	DBUG_ENTER("connpool::start_maintenance");
+	pthread_attr_t attr;
+	ping_interval=interval?interval:1;
+	stopping=false;
+	pthread_attr_init(&attr);
+	if(mysql_thread_create(key_thread_connpool_maintenance,&maintenance_thread,
+		&attr,connpool_maintenance,(void *)this))
+	{
+		pthread_attr_destroy(&attr);
+		DBUG_RETURN(1);
+	}
+	pthread_attr_destroy(&attr);
+	maintenance_running=true;
+	DBUG_RETURN(0);
+}
+
+void connpool::stop_maintenance()
+{
+	DBUG_ENTER("connpool::stop_maintenance");
+	if(!maintenance_running)
+		DBUG_VOID_RETURN;
+	mysql_mutex_lock(&mutex);
+	stopping=true;
+	mysql_cond_signal(&cond);
+	mysql_mutex_unlock(&mutex);
+	pthread_join(maintenance_thread,NULL);
+	maintenance_running=false;
+	DBUG_VOID_RETURN;
+}
+
+static void *connpool_warmup(void *arg)
+{
+	my_thread_init();
+	((connpool *)arg)->warmup_worker();
+	my_thread_end();
+	pthread_exit(0);
+	return NULL;
+}
+
+void connpool::warmup_worker()
+{
+	int32 idx;
+	while((idx=my_atomic_add32(&warmup_next,1))<warmup_count)
+		warmup_tasks[idx]->warm_one();
+	mysql_mutex_lock(&mutex);
+	if(!--warmup_running)
+		mysql_cond_broadcast(&warmup_cond);
+	mysql_mutex_unlock(&mutex);
+}
+
+/*
+  Open the warm-up connections of every backend at once. There is one task
+  per connection, served by up to MYDB_WARMUP_MAX_THREADS detached threads,
+  and every connect is bounded by connect_timeout. Plugin init therefore
+  waits about one connect round trip rather than one per connection. An
+  unreachable shard costs at most connect_timeout per task a thread
+  serves. Threads still running at the deadline finish in the background.
+*/
+int connpool::warmup()
+{
+	DBUG_ENTER("connpool::warmup");
+	connect_pool *pool;
+	pthread_attr_t attr;
+	pthread_t thread;
+	struct timespec abstime;
+	uint count=0,threads,target,idx;
+	for(pool=pools;pool;pool=pool->next)
+	{
+		target=pool->warmup_connections?pool->warmup_connections:warmup_connections;
+		count+=MY_MIN(target,pool->max_connections);
+	}
+	if(!count)
+		DBUG_RETURN(0);
+	if(!(warmup_tasks=(connect_pool **)my_malloc(count*sizeof(connect_pool *),MYF(MY_WME))))
+		DBUG_RETURN(1);
+	for(pool=pools;pool;pool=pool->next)
+	{
+		target=pool->warmup_connections?pool->warmup_connections:warmup_connections;
+		for(idx=MY_MIN(target,pool->max_connections);idx>0;idx--)
+			warmup_tasks[warmup_count++]=pool;
+	}
+	threads=MY_MIN(count,MYDB_WARMUP_MAX_THREADS);
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr,PTHREAD_CREATE_DETACHED);
+	mysql_mutex_lock(&mutex);
+	for(idx=0;idx<threads;idx++)
+	{
+		if(mysql_thread_create(key_thread_connpool_warmup,&thread,&attr,
+			connpool_warmup,(void *)this))
+			break;
+		warmup_running++;
+	}
+	pthread_attr_destroy(&attr);
+	set_timespec(abstime,(ulonglong)connect_timeout*((count+threads-1)/threads)+1);
+	while(warmup_running)
+	{
+		if(mysql_cond_timedwait(&warmup_cond,&mutex,&abstime))
+			break;
+	}
+	mysql_mutex_unlock(&mutex);
 	DBUG_RETURN(0);
 }
 
@@ -103,45 +711,29 @@ int connpool::pool_real_connect()
 int connpool::_init_connect()
 {
 	DBUG_ENTER("connpool::_init_connect");
-	instancepool=pools;
-	int idx1=0;
-	do
+	for(connect_pool *pool=pools;pool;pool=pool->next)
 	{
-		idx1++;
-		instancepool->free_length=MAX_CONNECTIONS;
-		for(uint idx=0;idx<MAX_CONNECTIONS;idx++){
-			instancepool->connections[idx].mysql=mysql_init(NULL);
-			instancepool->connections[idx].isused=false;
-			instancepool->connections[idx].isalive=false;
-		}
-		instancepool=pools->next;
-	}while(idx1<instances_count);
+		pool->connect_timeout=connect_timeout;
+		if(pool->init_connections(min_connections,max_connections))
+			DBUG_RETURN(1);
+	}
 	DBUG_RETURN(0);	
 }
 
 int connpool::init_instances()
 {
 	MYSQL_FILE *mf;
+	connect_pool *pool;
 	char buff[100],*ptr,*orgptr;
 	char *ininame="D:\\Soft\\MySqlImprove\\mysql-5.5.36\\sql\\data\\gather.ini"; 
 	if(!(mf= mysql_file_fopen(0,ininame,  O_RDONLY, MYF(0))))
 	{return -1;	}
 	int error,spacecount;
-	instances_count=0;
 	
 	while (mysql_file_fgets(buff, sizeof(buff) - 1, mf))
 	{
 		orgptr=buff;
-		instances_count++;
-		if(instances_count==1)
-		{
-			instancepool=pools;
-		}
-		else
-		{
-			instancepool->next = new connect_pool();
-			instancepool=instancepool->next;
-		}
+		pool=new connect_pool();
 		spacecount=0;
 		for(ptr=buff;ptr<buff+strlen(buff);ptr++)
 		{
@@ -153,128 +745,181 @@ int connpool::init_instances()
 				{
 					case 1:	
 						{
-							instancepool->param->instance->server=(char *)my_malloc(ptr-orgptr+1,MYF(0));
-							memcpy(instancepool->param->instance->server,orgptr,ptr-orgptr);
-							instancepool->param->instance->server[ptr-orgptr]=0;
+							pool->param->instance->server=(char *)my_malloc(ptr-orgptr+1,MYF(0));
+							memcpy(pool->param->instance->server,orgptr,ptr-orgptr);
+							pool->param->instance->server[ptr-orgptr]=0;
 							break;
 						}
-					case 2: instancepool->param->instance->sport=(ulong) my_strtoll10(orgptr, (char**) 0,
+					case 2: pool->param->instance->sport=(ulong) my_strtoll10(orgptr, (char**) 0,
 														  &error);
 							break;
 					case 3: 
 						{
-							instancepool->param->user=(char *)my_malloc(ptr-orgptr+1,MYF(0));
-							memcpy(instancepool->param->user,orgptr,ptr-orgptr);
-							instancepool->param->user[ptr-orgptr]=0;
+							pool->param->user=(char *)my_malloc(ptr-orgptr+1,MYF(0));
+							memcpy(pool->param->user,orgptr,ptr-orgptr);
+							pool->param->user[ptr-orgptr]=0;
 							break;
 						}
 					case 4: 
 						{
-							instancepool->param->password=(char *)my_malloc(ptr-orgptr+1,MYF(0));
-							memcpy(instancepool->param->password,orgptr,ptr-orgptr);
-							instancepool->param->password[ptr-orgptr]=0;
+							pool->param->password=(char *)my_malloc(ptr-orgptr+1,MYF(0));
+							memcpy(pool->param->password,orgptr,ptr-orgptr);
+							pool->param->password[ptr-orgptr]=0;
 							break;
 						}
 					case 5: 
 						{
-							instancepool->param->schema=(char *)my_malloc(ptr-orgptr+1,MYF(0));
-							memcpy(instancepool->param->schema,orgptr,ptr-orgptr);
-							instancepool->param->schema[ptr-orgptr]=0;
+							pool->param->schema=(char *)my_malloc(ptr-orgptr+1,MYF(0));
+							memcpy(pool->param->schema,orgptr,ptr-orgptr);
+							pool->param->schema[ptr-orgptr]=0;
 							break;
 						}
 					case 6: 
 						{
-							instancepool->param->table_name=(char *)my_malloc(ptr-orgptr+1,MYF(0));
-							memcpy(instancepool->param->table_name,orgptr,ptr-orgptr);
-							instancepool->param->table_name[ptr-orgptr]=0;
+							pool->param->table_name=(char *)my_malloc(ptr-orgptr+1,MYF(0));
+							memcpy(pool->param->table_name,orgptr,ptr-orgptr);
+							pool->param->table_name[ptr-orgptr]=0;
 							break;
 						}
+					case 7: pool->min_connections=(uint) my_strtoll10(orgptr, (char**) 0,
+														  &error);
+							break;
+					case 8: pool->max_connections=(uint) my_strtoll10(orgptr, (char**) 0,
+														  &error);
+							break;
+					case 9: pool->warmup_connections=(uint) my_strtoll10(orgptr, (char**) 0,
+														  &error);
+							break;
 				}
 				orgptr=ptr+1;
 			}
 		}
+		if(!pool->param->instance->server||add_backend(pool))
+			delete pool;
 	}
 	mysql_file_fclose(mf, MYF(0));
 	return 0;
 }
-mydb_value_list::mydb_value_list(mydb_value_list *mvl)
+
+/*
+  train_map lookups go through the pool as well. The routing instance
+  has credentials of its own, so it is registered up front instead of
+  being cloned from a shard backend by register_backend().
+*/
+int connpool::add_route_backend(CONNECT_PARAM *param)
 {
-	if(mvl->value!=NULL) 
+	char key[MYDB_BACKEND_KEY_LENGTH];
+	uint length=make_backend_key(key,param->instance->server,param->instance->sport,param->schema);
+	connect_pool *pool;
+	if(my_hash_search(&backends,(uchar *)key,length))
+		return 0;
+	pool=new connect_pool();
+	pool->param->instance->server=my_strdup(param->instance->server,MYF(0));
+	pool->param->instance->sport=param->instance->sport;
+	pool->param->user=my_strdup(param->user,MYF(0));
+	pool->param->password=my_strdup(param->password,MYF(0));
+	pool->param->schema=my_strdup(param->schema,MYF(0));
+	if(add_backend(pool))
 	{
-		value=(char *)my_malloc(strlen(mvl->value)+1,MYF(0));
-		strcpy(value,mvl->value);
-		value_type=mvl->value_type;
+		delete pool;
+		return 1;
 	}
-	else mydb_value_list();
+	return 0;
+}
+mydb_value_list::mydb_value_list(mydb_value_list *mvl,MEM_ROOT *root)
+{
+	value=mvl->value?strdup_root(root,mvl->value):NULL;
+	value_type=mvl->value?mvl->value_type:Item::INT_ITEM;
+}
 
+mydb_value_list::mydb_value_list(Item *item,MEM_ROOT *root)
+{
+	value=item?strdup_root(root,item->name):NULL;
+	value_type=item?item->type():Item::INT_ITEM;
 }
 
-mydb_value_list::mydb_value_list(Item *item)
+mydb_field_detail::mydb_field_detail(Item *item,MEM_ROOT *root)
 {
-	if(item)
-	{
-		value=(char *)my_malloc(strlen(item->name)+1,MYF(0));
-		strcpy(value,item->name);
-		value_type=item->type();
-	}
-	else
-		mydb_value_list();
+	TABLE *table=((Item_field *)item)->field->table;
+	field_table.schema_name=strdup_root(root,table->s->db.str);
+	field_table.table_alias=strdup_root(root,table->alias);
+	field_table.table_name=strdup_root(root,table->s->table_name.str);
+	field_table.is_alias_used=table->alias_name_used;
+	f_name=strdup_root(root,item->name);
 }
 
-mydb_field_cond::mydb_field_cond(mydb_field_cond *mfc):s_min(&mfc->s_min),s_max(&mfc->s_max)
+mydb_field_cond::mydb_field_cond(MEM_ROOT *root,mydb_field_cond *mfc)
+	:s_min(&mfc->s_min,root),s_max(&mfc->s_max,root)
 {
-	field_name=new mydb_field_detail();
-	field_name->f_name=(char *)my_malloc(strlen(mfc->field_name->f_name)+1,MYF(0));
-	strcpy(field_name->f_name,mfc->field_name->f_name);
-	field_name->field_table.table_alias=(char *)my_malloc(strlen(mfc->field_name->field_table.table_alias)+1,MYF(0));
-	strcpy(field_name->field_table.table_alias,mfc->field_name->field_table.table_alias);
-	field_name->field_table.schema_name=(char *)my_malloc(strlen(mfc->field_name->field_table.schema_name)+1,MYF(0));
-	strcpy(field_name->field_table.schema_name,mfc->field_name->field_table.schema_name);
-	field_name->field_table.table_name=(char *)my_malloc(strlen(mfc->field_name->field_table.table_name)+1,MYF(0));
-	strcpy(field_name->field_table.table_name,mfc->field_name->field_table.table_name);
+	mem_root=root;
+	field_name=new (root) mydb_field_detail();
+	field_name->f_name=strdup_root(root,mfc->field_name->f_name);
+	field_name->field_table.table_alias=strdup_root(root,mfc->field_name->field_table.table_alias);
+	field_name->field_table.schema_name=strdup_root(root,mfc->field_name->field_table.schema_name);
+	field_name->field_table.table_name=strdup_root(root,mfc->field_name->field_table.table_name);
 	field_name->field_table.is_alias_used = mfc->field_name->field_table.is_alias_used;
 	isRange=mfc->isRange;
+	op=mfc->op;
+	negated=mfc->negated;
 	List_iterator<mydb_value_list> li(mfc->values);
 	mydb_value_list *mvl;
 	while((mvl=li++))
 	{
-		mydb_value_list *ul=new mydb_value_list(mvl);
-		values.push_back(ul);
+		mydb_value_list *ul=new (root) mydb_value_list(mvl,root);
+		values.push_back(ul,root);
 	}
 }
 
-mydb_field_cond::mydb_field_cond():s_min(),s_max()
+mydb_field_cond::mydb_field_cond(MEM_ROOT *root):s_min(),s_max()
 {
+	mem_root=root;
 	isRange=false;
+	op=Item_func::UNKNOWN_FUNC;
+	negated=false;
 }
 
-mydb_field_cond::mydb_field_cond(Item *field,Item *value):s_min(),s_max()
+mydb_field_cond::mydb_field_cond(MEM_ROOT *root,Item *field,Item *value):s_min(),s_max()
 {
-	field_name=new mydb_field_detail(field);
+	mem_root=root;
+	field_name=new (root) mydb_field_detail(field,root);
 	isRange=false;
+	op=Item_func::UNKNOWN_FUNC;
+	negated=false;
 	addvalue(value);
 }
 
-mydb_field_cond::mydb_field_cond(Item *field,Item *minvalue,Item *maxvalue):s_min(minvalue),s_max(maxvalue)
+mydb_field_cond::mydb_field_cond(MEM_ROOT *root,Item *field,Item *minvalue,Item *maxvalue)
+	:s_min(minvalue,root),s_max(maxvalue,root)
 {
-	field_name=new mydb_field_detail(field);
+	mem_root=root;
+	field_name=new (root) mydb_field_detail(field,root);
 	isRange=true;
+	op=Item_func::UNKNOWN_FUNC;
+	negated=false;
+}
+
+void mydb_field_cond::setop(Item_func *func)
+{
+	op=func->functype();
+	negated=(op==Item_func::IN_FUNC||op==Item_func::BETWEEN)&&
+		((Item_func_opt_neg *)func)->negated;
 }
 
 void mydb_field_cond::setfield(Item *field)
 {
-	field_name=new mydb_field_detail(field);
+	field_name=new (mem_root) mydb_field_detail(field,mem_root);
 }
 
 void mydb_field_cond::addvalue(Item *value)
 {
-	mydb_value_list *mvl=new mydb_value_list(value);
-	values.push_back(mvl);
+	mydb_value_list *mvl=new (mem_root) mydb_value_list(value,mem_root);
+	values.push_back(mvl,mem_root);
 }
 
-mydb_field_cond::mydb_field_cond(Item *multilist):s_min(),s_max()
+mydb_field_cond::mydb_field_cond(MEM_ROOT *root,Item *multilist):s_min(),s_max()
 {
 	Item *ul=multilist->next;
+	mem_root=root;
 	_nodes=0;
 	do
 	{
@@ -290,6 +935,8 @@ mydb_field_cond::mydb_field_cond(Item *multilist):s_min(),s_max()
 		}
 	}while(ul=ul->next);
 	isRange=false;
+	op=Item_func::UNKNOWN_FUNC;
+	negated=false;
 }
 
 void list_sql_tree::_move_node(Item **conds,int nodes)
@@ -304,23 +951,46 @@ void list_sql_tree::_move_node(Item **conds,int nodes)
 	}
 }
 
-void list_sql_tree::_add_fields_2(Item *field,Item *value)
+void list_sql_tree::_add_fields_2(Item_func *func,Item *field,Item *value)
 {
-	mydb_field_cond *mfc=new mydb_field_cond(field,value);
-	fieldlist.push_back(mfc);
+	mydb_field_cond *mfc=new (&mem_root) mydb_field_cond(&mem_root,field,value);
+	mfc->setop(func);
+	fieldlist.push_back(mfc,&mem_root);
 }
-void list_sql_tree::_add_fields_3(Item *field,Item *minvalue,Item *maxvalue)
+void list_sql_tree::_add_fields_3(Item_func *func,Item *field,Item *minvalue,Item *maxvalue)
 {
-	mydb_field_cond *mfc=new mydb_field_cond(field,minvalue,maxvalue);
-	fieldlist.push_back(mfc);
+	mydb_field_cond *mfc=new (&mem_root) mydb_field_cond(&mem_root,field,minvalue,maxvalue);
+	mfc->setop(func);
+	fieldlist.push_back(mfc,&mem_root);
 }
-int list_sql_tree::_add_fields_n(Item *multilist)
+int list_sql_tree::_add_fields_n(Item_func *multilist)
 {
-	mydb_field_cond *mfc=new mydb_field_cond(multilist);
-	fieldlist.push_back(mfc);
+	mydb_field_cond *mfc=new (&mem_root) mydb_field_cond(&mem_root,multilist);
+	mfc->setop(multilist);
+	fieldlist.push_back(mfc,&mem_root);
 	return mfc->_nodes;
 }
 
+/*
+  The fields of a predicate that does not bound them, such as one under
+  OR or NOT: their conditions are inexact, so they cannot route.
+*/
+void list_sql_tree::_add_fields_inexact(Item *cond)
+{
+	List<Item_field> fields;
+	Item_field *item;
+	cond->walk(&Item::collect_item_field_processor,0,(uchar *)&fields);
+	List_iterator<Item_field> li(fields);
+	while((item=li++))
+	{
+		if(!item->field)
+			continue;
+		mydb_field_cond *mfc=new (&mem_root) mydb_field_cond(&mem_root);
+		mfc->setfield(item);
+		fieldlist.push_back(mfc,&mem_root);
+	}
+}
+
 int list_sql_tree::_list_sql_table_list()
 {
 	SELECT_LEX select_lex=list_thd->lex->select_lex;
@@ -330,16 +1000,13 @@ int list_sql_tree::_list_sql_table_list()
 	if(!lst_table) return -1;
 	do
 	{
-		mydb_schema_table *schema_table=new mydb_schema_table();
-		schema_table->schema_name=(char *)my_malloc(strlen(lst_table->db)+1,MYF(0));
-		strcpy(schema_table->schema_name,lst_table->db);
-		schema_table->table_name=(char *)my_malloc(strlen(lst_table->table_name)+1,MYF(0));
-		strcpy(schema_table->table_name,lst_table->table_name);
-		schema_table->table_alias=(char *)my_malloc(strlen(lst_table->alias)+1,MYF(0));
-		strcpy(schema_table->table_alias,lst_table->alias);
+		mydb_schema_table *schema_table=new (&mem_root) mydb_schema_table();
+		schema_table->schema_name=strdup_root(&mem_root,lst_table->db);
+		schema_table->table_name=strdup_root(&mem_root,lst_table->table_name);
+		schema_table->table_alias=strdup_root(&mem_root,lst_table->alias);
 
 		schema_table->is_alias_used=lst_table->table->alias_name_used;
-		tablelist.push_back(schema_table);
+		tablelist.push_back(schema_table,&mem_root);
 	}while(lst_table=lst_table->next_leaf);
 	return 0;
 }
@@ -352,7 +1019,9 @@ int list_sql_tree::_list_lex_where_tree(COND *cond)
 		//ݲĿƶ
 		switch(((Item_func*) cond)->functype())
 		{
-		case Item_func::NOT_FUNC:break;
+		case Item_func::NOT_FUNC:
+			_add_fields_inexact(cond);
+			break;
 		case Item_func::EQ_FUNC://Ԫ
 		case Item_func::EQUAL_FUNC:
 		case Item_func::NE_FUNC:
@@ -369,11 +1038,11 @@ int list_sql_tree::_list_lex_where_tree(COND *cond)
 				{
 					if(left_item->type() == Item::FIELD_ITEM)
 					{
-						_add_fields_2(left_item,right_item);
+						_add_fields_2((Item_func*) cond,left_item,right_item);
 					}
 					else
 					{
-						_add_fields_2(right_item,left_item);
+						_add_fields_2((Item_func*) cond,right_item,left_item);
 					}
 				}
 				else
@@ -387,7 +1056,7 @@ int list_sql_tree::_list_lex_where_tree(COND *cond)
 				Item *right_item= ((Item_func*) cond)->arguments()[2];
 				if(left_item->type() == Item::FIELD_ITEM)
 				{
-					_add_fields_3(left_item,mid_item,right_item);
+					_add_fields_3((Item_func*) cond,left_item,mid_item,right_item);
 				}
 				else
 				{}
@@ -395,7 +1064,7 @@ int list_sql_tree::_list_lex_where_tree(COND *cond)
 			}
 		case Item_func::IN_FUNC:
 			{
-				_add_fields_n(cond);
+				_add_fields_n((Item_func*) cond);
 				break;//Ԫ	
 			}
 		}
@@ -403,18 +1072,34 @@ int list_sql_tree::_list_lex_where_tree(COND *cond)
 	return 0;
 }
 
-int list_sql_tree::list_lex_tree()
+/*
+  The conditions of cond, the one pushed for the table. Without engine
+  condition pushdown nothing is pushed, and the WHERE of the statement
+  is read instead.
+*/
+int list_sql_tree::list_lex_tree(COND *cond)
 {
-	if(list_thd->lex->select_lex.join==0) return -1;
 	JOIN *join=list_thd->lex->select_lex.join;
+	if(!cond&&!join) return -1;
 	_list_sql_table_list();
-	return _list_lex_tree(join->conds);
+	if(!cond&&!(list_thd->variables.optimizer_switch&OPTIMIZER_SWITCH_ENGINE_CONDITION_PUSHDOWN))
+		cond=join->conds;
+	return cond?_list_lex_tree(cond):0;
 }
 
+/*
+  Only the conjuncts of a top-level AND bound the rows; the fields under
+  an OR or XOR are recorded as inexact instead, see _add_fields_inexact().
+*/
 int list_sql_tree::_list_lex_tree(COND *conds)
 {	
 	if (conds->type() == Item::COND_ITEM)
 	{
+		if(((Item_cond*) conds)->functype()!=Item_func::COND_AND_FUNC)
+		{
+			_add_fields_inexact(conds);
+			return 0;
+		}
 		List_iterator<Item> li(*((Item_cond*) conds)->argument_list());
 		Item *item;
 		while ((item=li++))
@@ -457,6 +1142,12 @@ mydb_field_cond* list_sql_tree::_is_filed_in_list(mydb_field_cond *fl)
 void list_sql_tree::_merge_field_cond(mydb_field_cond* mfiled,mydb_field_cond* filed)
 {
 	int error=0;
+	/* the merged values must not prune what either condition lets through */
+	if(!filed->exact()||filed->isRange!=mfiled->isRange)
+	{
+		mfiled->op=Item_func::UNKNOWN_FUNC;
+		return;
+	}
 	if(filed->isRange)
 	{
 		if(filed->s_max.value_type==Item::INT_ITEM)
@@ -467,8 +1158,7 @@ void list_sql_tree::_merge_field_cond(mydb_field_cond* mfiled,mydb_field_cond* f
 			if(f_max>m_max)
 			{
 				int10_to_str(f_max,s_max,0);
-				mfiled->s_max.value=(char *)my_malloc(strlen(s_max)+1,MYF(0));
-				strcpy(mfiled->s_max.value,s_max);
+				mfiled->s_max.value=strdup_root(&mem_root,s_max);
 			}
 		}
 		if(filed->s_min.value_type==Item::INT_ITEM)
@@ -479,8 +1169,7 @@ void list_sql_tree::_merge_field_cond(mydb_field_cond* mfiled,mydb_field_cond* f
 			if(f_min<m_min)
 			{
 				int10_to_str(f_min,s_min,0);
-				mfiled->s_min.value=(char *)my_malloc(strlen(s_min)+1,MYF(0));
-				strcpy(mfiled->s_min.value,s_min);
+				mfiled->s_min.value=strdup_root(&mem_root,s_min);
 			}		
 		}
 	}
@@ -503,8 +1192,8 @@ void list_sql_tree::_merge_field_cond(mydb_field_cond* mfiled,mydb_field_cond* f
 			}
 			if(!bflag)
 			{
-				mydb_value_list *mvl=new   mydb_value_list(vl);//(&mem_root)
-				mfiled->values.push_back(mvl);
+				mydb_value_list *mvl=new (&mem_root) mydb_value_list(vl,&mem_root);
+				mfiled->values.push_back(mvl,&mem_root);
 			}
 		}
 	}
@@ -522,68 +1211,46 @@ int list_sql_tree::list_lex_merge()
 		}
 		else
 		{
-			mydb_field_cond *ll=new mydb_field_cond(ul);// (&mem_root)
-			mergelist.push_back(ll);
+			mydb_field_cond *ll=new (&mem_root) mydb_field_cond(&mem_root,ul);
+			mergelist.push_back(ll,&mem_root);
 		}		
 	}
 	return 0;
 }
 
 
-int shard_table_map::init()
+static uchar* table_get_key(char *table_name, size_t *length,
+                             my_bool not_used __attribute__((unused)))
 {
-	//ȡshardϢ
-	if(mysql==NULL)
-		mysql=mysql_init(NULL);
-	if(mysql==NULL)
-	{
-		return 1;
-	}
-	if(!mysql_real_connect(mysql,sharding_instance.server,
-								 sharding_instance_param.user,
-								 sharding_instance_param.password,
-								 sharding_instance_param.schema,
-								 sharding_instance.sport,
-								 MYSQL_UNIX_ADDR,0))
-	{
-		return 2;
-	}
-	char query[100];
-	sprintf(query,"select table_name from %s",MYDB_TABLE_MAP);
-	mysql_real_query(mysql,query,strlen(query));
-	MYSQL_RES *result=mysql_store_result(mysql);
-	if(!result)
-	{
-		goto err;
-	}
-	MYSQL_ROW row;
-	int idx=0;
-	while(row=mysql_fetch_row(result))
+	*length=strlen(table_name);
+	return (uchar*) table_name;
+}
+
+/* rows is the table_name column of table_map */
+int shard_table_map::init(route_rows *rows)
+{
+	if(!rows->fields)
+		return -1;
+	if(my_hash_init(&tables,&my_charset_bin,rows->count+1,0,0,
+		(my_hash_get_key) table_get_key,(my_hash_free_key) my_free,HASH_UNIQUE))
+		return -1;
+	loaded=true;
+	for(uint idx=0;idx<rows->count;idx++)
 	{
-		char *t=(char *)my_malloc(strlen(row[0])+1,MYF(0));
-		strcpy(t,row[0]);
-		table_map[idx]=t;
-		idx++;
+		MYSQL_ROW row=rows->row(idx);
+		if(!row[0])
+			continue;
+		char *t=my_strdup(row[0],MYF(0));
+		if(t&&my_hash_insert(&tables,(uchar *)t))
+			my_free(t);
 	}
-	mysql_close(mysql);	
-	return 0;	
-err:
-	mysql_close(mysql);	
-	return -1;
+	return 0;
 }
 
+/* exact match, the set is not changed once init() has filled it */
 bool shard_table_map::table_in_list(const char *table_name)
 {
-	char **li=table_map;
-	char *ul;
-	while((ul=*li++))
-	{
-		if(mydb_strcmp(ul,table_name,strlen(ul)))
-		{
-			return true;
-		}
-	}
-	return false;
+	return loaded&&my_hash_search(&tables,(uchar *)table_name,strlen(table_name));
 }
 
 int list_sql_tree::_fetch_field_cond(mydb_field_cond *mfc,char *c_cond)
@@ -618,124 +1285,300 @@ int list_sql_tree::_fetch_field_cond(mydb_field_cond *mfc,char *c_cond)
 
 int list_sql_tree::_list_field_cond()
 {
-	list_node *ln=mergelist.first_node();
+	List_iterator<mydb_field_cond> li(mergelist);
 	mydb_field_cond *ul;
-	char *where_c=(char *)my_malloc(MYDB_MAX_SQL_LENGTH,MYF(0));
-	*where_c='\0';
+	char *where_c;
 	int idx=0;
-	do
+	while((ul=li++))
 	{
-		ul=(mydb_field_cond *)ln->info;
+		/* an inexact condition must not narrow the shards read */
+		if(!ul->exact()||(!ul->isRange&&ul->values.is_empty()))
+			continue;
 		if(mydb_strcmp(ul->field_name->f_name,MYDB_TRAIN_MAP_ID,strlen(MYDB_TRAIN_MAP_ID))
 			||mydb_strcmp(ul->field_name->f_name,MYDB_PACKAGE_MAP_ID,strlen(MYDB_PACKAGE_MAP_ID)))
 		{
+			if(!(where_c=(char *)alloc_root(&mem_root,MYDB_MAX_SQL_LENGTH)))
+				break;
+			*where_c='\0';
 			_fetch_field_cond(ul,where_c);
-			where_cond.push_back(where_c);
+			where_cond.push_back(where_c,&mem_root);
 			idx++;
 		}
-		ln=ln->next;
-	}while(ln->info);
+	}
 	return idx;
 }
 
 char *list_sql_tree::_make_where_str()
 {
-	list_node *ln=where_cond.first_node(); 
-	char *result=(char *)my_malloc(MYDB_MAX_SQL_LENGTH,MYF(0));
+	List_iterator<char> li(where_cond);
+	char *result=(char *)alloc_root(&mem_root,MYDB_MAX_SQL_LENGTH);
 	*result='\0';
 	char *ul;
 	int idx=0;
-	do
+	while((ul=li++))
 	{
 		if(idx>0)strcat(result," and ");
-		ul=(char *)ln->info;
 		strcat(result,"(");
 		strcat(result,ul);
 		strcat(result,")");
 		idx++;
-		ln=ln->next;
-	}while(ln->info);
+	}
 	return result;
 }
 
 int list_sql_tree::_make_shard_command(char *result)
 {
-	_list_field_cond();
-	sprintf(result,"select serverip,serverport,shard_schema,shard_prefix from %s where %s",MYDB_TRAIN_MAP,_make_where_str());
+	if(_list_field_cond())
+		sprintf(result,"select serverip,serverport,shard_schema,shard_prefix from %s where %s",MYDB_TRAIN_MAP,_make_where_str());
+	else
+		sprintf(result,"select serverip,serverport,shard_schema,shard_prefix from %s",MYDB_TRAIN_MAP);
 	return 0;
 }
 
-//ѯȡѯб
-int list_sql_tree::get_shard_table_info()
+/*
+  The routing condition of the statement when it is the only one, NULL
+  otherwise. field is set to the canonical name of the column.
+*/
+mydb_field_cond *list_sql_tree::_route_single_cond(const char **field)
 {
-	char sql_command[MYDB_MAX_SQL_LENGTH];
-	_make_shard_command(sql_command);
-	mysql=mysql_init(NULL);
+	List_iterator<mydb_field_cond> li(mergelist);
+	mydb_field_cond *mfc,*point=NULL;
+	while((mfc=li++))
+	{
+		const char *name;
+		if(mydb_strcmp(mfc->field_name->f_name,MYDB_TRAIN_MAP_ID,strlen(MYDB_TRAIN_MAP_ID)))
+			name=MYDB_TRAIN_MAP_ID;
+		else if(mydb_strcmp(mfc->field_name->f_name,MYDB_PACKAGE_MAP_ID,strlen(MYDB_PACKAGE_MAP_ID)))
+			name=MYDB_PACKAGE_MAP_ID;
+		else
+			continue;
+		if(point||!mfc->exact()||(!mfc->isRange&&mfc->values.is_empty()))
+			return NULL;
+		point=mfc;
+		*field=name;
+	}
+	return point;
+}
 
-	if(!mysql_real_connect(mysql,sharding_instance.server,
-								 sharding_instance_param.user,
-								 sharding_instance_param.password,
-								 sharding_instance_param.schema,
-								 sharding_instance.sport,
-								 NULL,0))
+/*
+  Route by the sharding function of the statement's sharded tables. They
+  must all share one shard_rule; -1 leaves routing to train_map. Only one
+  =, <=>, IN or BETWEEN on the rule's column of such a table prunes; with
+  anything else every node is scanned, which is always correct as the
+  table lives on those nodes only.
+*/
+int list_sql_tree::_route_rule()
+{
+	List_iterator<mydb_schema_table> ti(tablelist);
+	List_iterator<mydb_field_cond> li(mergelist);
+	mydb_schema_table *mst;
+	mydb_field_cond *mfc,*point=NULL;
+	shard_rule *rule=NULL,*table_rule;
+	if(!routing||!routing->rules)
+		return -1;
+	while((mst=ti++))
 	{
-		return 2;
+		if(!routing->tables.table_in_list(mst->table_name))
+			continue;
+		if(!(table_rule=routing->rules->find(mst->table_name))||
+			(rule&&rule!=table_rule))
+			return -1;
+		rule=table_rule;
 	}
-	mysql_real_query(mysql,sql_command,strlen(sql_command));
-	MYSQL_RES *result=mysql_store_result(mysql);
+	if(!rule)
+		return -1;
+	while((mfc=li++))
+	{
+		if(my_strcasecmp(system_charset_info,mfc->field_name->f_name,rule->field)||
+			!routing->tables.table_in_list(mfc->field_name->field_table.table_name)||
+			routing->rules->find(mfc->field_name->field_table.table_name)!=rule)
+			continue;
+		if(point||!mfc->exact())
+		{
+			point=NULL;
+			break;
+		}
+		point=mfc;
+	}
+	if(!point)
+	{
+		rule->all_nodes(&shard_info,&mem_root,&route_keys);
+		return 0;
+	}
+	route_cond=point;
+	if(point->isRange)
+		rule->route_range(point->s_min.value,point->s_max.value,&shard_info,&mem_root,&route_keys);
+	else
+		rule->route_values(&point->values,&shard_info,&mem_root,&route_keys);
+	return 0;
+}
+
+static void set_route(ROUTE *route,MYSQL_ROW row)
+{
+	int error;
+	route->server=row[0]?row[0]:(char *)"";
+	route->sport=row[1]?(uint) my_strtoll10(row[1],(char**) 0,&error):0;
+	route->schema=row[2]?row[2]:(char *)"";
+	route->prefix=row[3]?row[3]:(char *)"";
+}
+
+static uint make_route_key(char *key,const char *field,const char *value)
+{
+	uint length=(uint) my_snprintf(key,MYDB_ROUTE_KEY_LENGTH,"%s=%s",field,value);
+	/* a truncated key could name another value */
+	return length<MYDB_ROUTE_KEY_LENGTH-1?length:0;
+}
+
+/* value as a quoted string literal of the routing instance */
+static bool append_quoted(String *sql,const char *value)
+{
+	size_t length=strlen(value),escaped;
+	if(sql->append('\'')||sql->reserve(2*length+2))
+		return true;
+	escaped=escape_string_for_mysql(system_charset_info,(char *)sql->ptr()+sql->length(),
+		2*length+1,value,length);
+	if(escaped==(size_t) -1)
+		return true;
+	sql->length(sql->length()+escaped);
+	return sql->append('\'');
+}
+
+/*
+  Resolve a list of routing values through the route cache. The values
+  that miss are read from train_map with one query and cached, including
+  those with no row. Rows are matched back to values the way the routing
+  instance compares them; when some row matches none of the values no
+  negative entry is cached, as the match cannot be trusted then.
+*/
+int list_sql_tree::_route_cached(mydb_field_cond *mfc,const char *field)
+{
+	char key[MYDB_ROUTE_KEY_LENGTH];
+	List<mydb_value_list> missing;
+	List_iterator<mydb_value_list> li(mfc->values);
+	mydb_value_list *value;
+	ulonglong version=rcache->current_version();
+	uint length;
+	while((value=li++))
+	{
+		length=make_route_key(key,field,value->value);
+		if(!length||rcache->lookup(key,length,&shard_info,&mem_root,&route_keys,value->value)<0)
+			missing.push_back(value,&mem_root);
+	}
+	if(missing.is_empty())
+		return 0;
+
+	String sql;
+	sql.append(STRING_WITH_LEN("select "));
+	sql.append(field);
+	sql.append(STRING_WITH_LEN(",serverip,serverport,shard_schema,shard_prefix from "));
+	sql.append(MYDB_TRAIN_MAP);
+	sql.append(STRING_WITH_LEN(" where "));
+	sql.append(field);
+	sql.append(STRING_WITH_LEN(" in ("));
+	List_iterator<mydb_value_list> mi(missing);
+	MYSQL_RES *result=NULL;
+	bool oom=false;
+	for(uint idx=0;(value=mi++);idx++)
+	{
+		if(idx) oom|=sql.append(',');
+		oom|=append_quoted(&sql,value->value);
+	}
+	if(!oom&&!sql.append(')'))
+		result=cpool->store_query(&sharding_instance_param,sql.ptr(),sql.length(),
+			wait_timeout);
 	if(!result)
 	{
-		goto err;
+		/* the cache hits alone would read too few shards */
+		shard_info.empty();
+		route_keys.disable();
+		return -1;
 	}
+
 	MYSQL_ROW row;
-	int error=0;
-	while(row=mysql_fetch_row(result))
-	{
-		CONNECT_PARAM *mcp=(CONNECT_PARAM *)my_malloc(sizeof(CONNECT_PARAM),MYF(0));
-		mcp->instance=(MYSQL_INSTANCE *)my_malloc(sizeof(MYSQL_INSTANCE),MYF(0));
-		mcp->instance->server=(char *)my_malloc(strlen(row[0])+1,MYF(0));
-		strcpy(mcp->instance->server,row[0]);
-		mcp->instance->sport=my_strtoll10(row[1], (char**) 0, &error);
-		mcp->schema=(char *)my_malloc(strlen(row[2])+1,MYF(0));
-		strcpy(mcp->schema,row[2]);
-		mcp->table_name=(char *)my_malloc(strlen(row[3])+1,MYF(0));
-		strcpy(mcp->table_name,row[3]);
-		shard_info.push_back(mcp);
+	ROUTE route;
+	List<mydb_value_list> unknown;
+	uint idx,rows=(uint) mysql_num_rows(result);
+	bool *matched=(bool *)my_malloc(rows*sizeof(bool)+1,MYF(MY_WME|MY_ZEROFILL));
+	ROUTE *routes=(ROUTE *)my_malloc(rows*sizeof(ROUTE)+1,MYF(MY_WME));
+	while((row=mysql_fetch_row(result)))
+	{
+		set_route(&route,row+1);
+		add_shard_route(&shard_info,&mem_root,&route);
 	}
-	mysql_free_result(result);
-	mysql_close(mysql);	
-	return 0;	
-err:
-	mysql_close(mysql);	
-	return -1;	
-}
-
-int list_sql_tree::resetup_sql_command(shard_table_map *stm1)
-{
-	sql_commands=(char **)my_malloc(sizeof(char **),MYF(0));
-	char **cursor=sql_commands;
-	List_iterator<CONNECT_PARAM> ui(shard_info);
-	CONNECT_PARAM *mcp;
-	while((mcp=ui++))
-	{
-		List_iterator<mydb_schema_table> li(tablelist);
-		mydb_schema_table *mst;
-		char *sql_command=(char *)my_malloc(MYDB_MAX_SQL_LENGTH,MYF(0));
-		char sql_tmp[MYDB_MAX_SQL_LENGTH];
-		strcpy(sql_command,_query);
-		sql_tmp[0]='\0';
-		while((mst=li++))
+	if(!matched||!routes)
+	{
+		route_keys.disable();
+		goto end;
+	}
+	mi.rewind();
+	while((value=mi++))
+	{
+		uint count=0;
+		mysql_data_seek(result,0);
+		for(idx=0;(row=mysql_fetch_row(result));idx++)
 		{
-			if(stm1->table_in_list(mst->table_name))
+			if(row[0]&&!my_strcasecmp(system_charset_info,row[0],value->value))
 			{
-				char fullname[MYDB_MAX_SQL_LENGTH];
-				sprintf(fullname,"%s.%s%s",mcp->schema,mcp->table_name,mst->table_name);
-				mydb_strreplace(sql_tmp,sql_command,mst->table_name,fullname);
-				strcpy(sql_command,sql_tmp);
+				set_route(&routes[count],row+1);
+				route_keys.add(add_shard_route(&shard_info,&mem_root,&routes[count++]),value->value);
+				matched[idx]=true;
 			}
 		}
-		*cursor=sql_command;
-		cursor++;
+		if(!count)
+			unknown.push_back(value,&mem_root);
+		else if((length=make_route_key(key,field,value->value)))
+			rcache->insert(key,length,routes,count,version);
+	}
+	for(idx=0;idx<rows&&matched[idx];idx++);
+	if(idx<rows)
+	{
+		/* a shard came from a row no value accounts for */
+		route_keys.disable();
+		goto end;
+	}
+	mi.init(unknown);
+	while((value=mi++))
+	{
+		route_keys.add_none(value->value);
+		if((length=make_route_key(key,field,value->value)))
+			rcache->insert(key,length,NULL,0,version);
+	}
+end:
+	my_free(matched);
+	my_free(routes);
+	mysql_free_result(result);
+	return 0;
+}
+
+//ѯȡѯб
+int list_sql_tree::get_shard_table_info()
+{
+	const char *field;
+	if(!_route_rule())
+		return 0;
+	mydb_field_cond *mfc=_route_single_cond(&field);
+	route_cond=mfc;
+	if(mfc&&mfc->isRange&&routing&&routing->ranges&&
+		routing->ranges->lookup(field,mfc->s_min.value,mfc->s_max.value,
+			&shard_info,&mem_root,&route_keys)>=0)
+		return 0;
+	if(mfc&&!mfc->isRange&&rcache&&rcache->max_entries)
+		return _route_cached(mfc,field);
+	route_keys.disable();
+
+	char sql_command[MYDB_MAX_SQL_LENGTH];
+	_make_shard_command(sql_command);
+	MYSQL_RES *result=cpool->store_query(&sharding_instance_param,sql_command,
+		strlen(sql_command),wait_timeout);
+	if(!result)
+		return -1;
+	MYSQL_ROW row;
+	ROUTE route;
+	while((row=mysql_fetch_row(result)))
+	{
+		set_route(&route,row);
+		add_shard_route(&shard_info,&mem_root,&route);
 	}
+	mysql_free_result(result);
 	return 0;
 }
\ No newline at end of file
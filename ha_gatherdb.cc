@@ -93,6 +93,8 @@
 #include "sql_class.h"           // MYSQL_HANDLERTON_INTERFACE_VERSION
 #include <mysql/plugin.h>
 #include "mysql.h"
+#include "errmsg.h"
+#include "mysqld_error.h"
 
 #ifdef USE_PRAGMA_IMPLEMENTATION
 #pragma implementation        // gcc: Class implementation
@@ -123,6 +125,28 @@ static bool gatherdb_is_supported_system_table(const char *db,
 */
 static HASH gatherdb_open_tables;
 static connpool *cp;
+static scatter_pool *sp;
+static route_cache *rc;
+static plan_cache *pc;
+static route_state *rs;
+
+static uint gatherdb_pool_min_connections;
+static uint gatherdb_pool_max_connections;
+static uint gatherdb_pool_ping_interval;
+static uint gatherdb_pool_warmup_connections;
+static uint gatherdb_connect_timeout;
+static ulong gatherdb_pool_wait_timeout;
+static uint gatherdb_scatter_threads;
+static my_bool gatherdb_stream_results;
+static uint gatherdb_fetch_batch_rows;
+static ulong gatherdb_query_memory_limit;
+static uint gatherdb_route_cache_size;
+static uint gatherdb_route_cache_ttl;
+static uint gatherdb_route_cache_negative_ttl;
+static my_bool gatherdb_route_cache_flush;
+static uint gatherdb_plan_cache_size;
+static uint gatherdb_route_refresh_interval;
+static char *gatherdb_route_snapshot_file;
 /* The mutex used to init the hash; variable for gatherdb share methods */
 mysql_mutex_t gatherdb_mutex;
 
@@ -140,11 +164,51 @@ static uchar* gatherdb_get_key(GATHERDB_SHARE *share, size_t *length,
 
 #ifdef HAVE_PSI_INTERFACE
 static PSI_mutex_key ex_key_mutex_gatherdb, ex_key_mutex_GATHERDB_SHARE_mutex;
+PSI_rwlock_key key_rwlock_gatherdb_backends;
+PSI_mutex_key key_mutex_connpool, key_mutex_connect_pool_wait;
+PSI_mutex_key key_mutex_scatter_pool, key_mutex_scatter_job;
+PSI_mutex_key key_mutex_route_cache, key_mutex_route_state, key_mutex_plan_cache;
+PSI_cond_key key_cond_connpool, key_cond_connpool_warmup,
+             key_cond_connect_pool_wait;
+PSI_cond_key key_cond_scatter_pool, key_cond_scatter_job;
+PSI_cond_key key_cond_route_state;
+PSI_thread_key key_thread_connpool_maintenance, key_thread_connpool_warmup;
+PSI_thread_key key_thread_scatter_worker, key_thread_route_refresh;
 
 static PSI_mutex_info all_gatherdb_mutexes[]=
 {
   { &ex_key_mutex_gatherdb, "gatherdb", PSI_FLAG_GLOBAL},
-  { &ex_key_mutex_GATHERDB_SHARE_mutex, "GATHERDB_SHARE::mutex", 0}
+  { &ex_key_mutex_GATHERDB_SHARE_mutex, "GATHERDB_SHARE::mutex", 0},
+  { &key_mutex_connpool, "connpool::mutex", PSI_FLAG_GLOBAL},
+  { &key_mutex_connect_pool_wait, "connect_pool::wait_mutex", 0},
+  { &key_mutex_scatter_pool, "scatter_pool::mutex", PSI_FLAG_GLOBAL},
+  { &key_mutex_scatter_job, "scatter_job::mutex", 0},
+  { &key_mutex_route_cache, "route_cache::mutex", PSI_FLAG_GLOBAL},
+  { &key_mutex_route_state, "route_state::mutex", PSI_FLAG_GLOBAL},
+  { &key_mutex_plan_cache, "plan_cache::mutex", PSI_FLAG_GLOBAL}
+};
+
+static PSI_rwlock_info all_gatherdb_rwlocks[]=
+{
+  { &key_rwlock_gatherdb_backends, "connpool::backends_lock", PSI_FLAG_GLOBAL}
+};
+
+static PSI_cond_info all_gatherdb_conds[]=
+{
+  { &key_cond_connpool, "connpool::cond", PSI_FLAG_GLOBAL},
+  { &key_cond_connpool_warmup, "connpool::warmup_cond", PSI_FLAG_GLOBAL},
+  { &key_cond_connect_pool_wait, "connect_pool::wait_cond", 0},
+  { &key_cond_scatter_pool, "scatter_pool::cond", PSI_FLAG_GLOBAL},
+  { &key_cond_scatter_job, "scatter_job::cond", 0},
+  { &key_cond_route_state, "route_state::cond", PSI_FLAG_GLOBAL}
+};
+
+static PSI_thread_info all_gatherdb_threads[]=
+{
+  { &key_thread_connpool_maintenance, "connpool_maintenance", PSI_FLAG_GLOBAL},
+  { &key_thread_connpool_warmup, "connpool_warmup", 0},
+  { &key_thread_scatter_worker, "scatter_worker", 0},
+  { &key_thread_route_refresh, "route_refresh", PSI_FLAG_GLOBAL}
 };
 
 static void init_gatherdb_psi_keys()
@@ -157,15 +221,31 @@ static void init_gatherdb_psi_keys()
 
   count= array_elements(all_gatherdb_mutexes);
   PSI_server->register_mutex(category, all_gatherdb_mutexes, count);
+
+  count= array_elements(all_gatherdb_rwlocks);
+  PSI_server->register_rwlock(category, all_gatherdb_rwlocks, count);
+
+  count= array_elements(all_gatherdb_conds);
+  PSI_server->register_cond(category, all_gatherdb_conds, count);
+
+  count= array_elements(all_gatherdb_threads);
+  PSI_server->register_thread(category, all_gatherdb_threads, count);
 }
 #endif
 
-static void cpool_init_func()
+static int cpool_init_func()
 {
 	cp=new connpool();
-	cp->init();
+	if(cp->init())
+		return 1;
+	cp->min_connections=gatherdb_pool_min_connections;
+	cp->max_connections=gatherdb_pool_max_connections;
+	cp->warmup_connections=gatherdb_pool_warmup_connections;
+	cp->connect_timeout=gatherdb_connect_timeout;
 	cp->init_instances();
 	cp->_init_connect();
+	cp->warmup();
+	return 0;
 }
 
 static int gatherdb_init_func(void *p)
@@ -187,7 +267,37 @@ static int gatherdb_init_func(void *p)
   gatherdb_hton->system_database=   NULL;
   gatherdb_hton->is_supported_system_table= gatherdb_is_supported_system_table;
   //ʼӻ
-  cpool_init_func();
+  if (cpool_init_func())
+    DBUG_RETURN(1);
+  if (cp->start_maintenance(gatherdb_pool_ping_interval))
+    DBUG_RETURN(1);
+  sp=new scatter_pool();
+  if (sp->start(gatherdb_scatter_threads))
+    DBUG_RETURN(1);
+  rc=new route_cache();
+  if (rc->init())
+    DBUG_RETURN(1);
+  rc->max_entries= gatherdb_route_cache_size;
+  rc->ttl= gatherdb_route_cache_ttl;
+  rc->negative_ttl= gatherdb_route_cache_negative_ttl;
+  pc=new plan_cache();
+  if (pc->init())
+    DBUG_RETURN(1);
+  pc->max_entries= gatherdb_plan_cache_size;
+  /*
+    Route from the saved snapshot when there is one and let the thread
+    check it; a routing snapshot that cannot be loaded now is retried.
+  */
+  rs=new route_state();
+  if (rs->init(cp, rc))
+    DBUG_RETURN(1);
+  rs->refresh_interval= gatherdb_route_refresh_interval;
+  rs->wait_timeout= gatherdb_pool_wait_timeout;
+  rs->snapshot_file= gatherdb_route_snapshot_file;
+  if (rs->load_file())
+    (void) rs->refresh();
+  if (rs->start_refresh())
+    DBUG_RETURN(1);
   DBUG_RETURN(0);
 }
 
@@ -202,6 +312,19 @@ static int gatherdb_done_func(void *p)
   my_hash_free(&gatherdb_open_tables);
   mysql_mutex_destroy(&gatherdb_mutex);
   //ͷӻ
+  if (sp)
+    sp->stop();
+  if (rs)
+    rs->dispose();
+  if (rc)
+    rc->dispose();
+  if (pc)
+    pc->dispose();
+  if (cp)
+  {
+    cp->stop_maintenance();
+    cp->dispose();
+  }
   DBUG_RETURN(error);
 }
 
@@ -288,12 +411,38 @@ static handler* gatherdb_create_handler(handlerton *hton,
   return new (mem_root) ha_gatherdb(hton, table);
 }
 
+/*
+  An aggregated field of a shard: how many of the rows rebuilt from its
+  partials hold a value and, for an exact SUM, the part of the sum still
+  to be spread over them, in rest[current], and the range of the field.
+*/
+struct mydb_agg_rest
+{
+  ha_rows count;
+  my_decimal rest[2];
+  uint current;
+  my_decimal min, max;
+};
+
 ha_gatherdb::ha_gatherdb(handlerton *hton, TABLE_SHARE *table_arg)
   :handler(hton, table_arg)
 {
 	cpool=cp;
-	cpool->pool_real_connect();
+	spool=sp;
+	rcache=rc;
+	pcache=pc;
+	rstate=rs;
 	lst=0;
+	job=0;
+	batch=0;
+	sources=0;
+	merge_next=0;
+	merging=false;
+	agg_row=0;
+	agg_lengths=0;
+	agg_rows=agg_index=0;
+	agg_rests=0;
+	pushed=0;
 }
 
 
@@ -319,16 +468,6 @@ static const char *ha_gatherdb_exts[] = {
   NullS
 };
 
-static void* init_table_map()
-{
-	if(stm==NULL)
-	{
-		stm=new shard_table_map();
-		stm->init();
-	}
-	return NULL;
-}
-
 const char **ha_gatherdb::bas_ext() const
 {
   return ha_gatherdb_exts;
@@ -392,7 +531,7 @@ static bool gatherdb_is_supported_system_table(const char *db,
     convert_row_to_internal_format()
       record    Byte pointer to record
       row       MySQL result set row from fetchrow()
-      result	Result set to use
+      lengths	Lengths of the row values
 
   DESCRIPTION
     This method simply iterates through a row returned via fetchrow with
@@ -407,17 +546,24 @@ static bool gatherdb_is_supported_system_table(const char *db,
 
 uint ha_gatherdb::convert_row_to_internal_format(uchar *record,
                                                   MYSQL_ROW row,
-                                                  MYSQL_RES *result)
+                                                  ulong *lengths)
 {
-  ulong *lengths;
   Field **field;
   my_bitmap_map *old_map= dbug_tmp_use_all_columns(table, table->write_set);
+  /* a projected row has only the fields lst->projection lists */
+  uint *projection= lst && lst->projected ? lst->projection : NULL;
+  uint *projection_end= projection ? projection + lst->projection_count : NULL;
   DBUG_ENTER("ha_gatherdb::convert_row_to_internal_format");
 
-  lengths= mysql_fetch_lengths(result);
-
-  for (field= table->field; *field; field++, row++, lengths++)
+  for (field= table->field; *field; field++)
   {
+    if (projection)
+    {
+      if (projection == projection_end ||
+          *projection != (*field)->field_index)
+        continue;
+      projection++;
+    }
     /*
       index variable to move us through the row at the
       same iterative step as the field
@@ -439,6 +585,8 @@ uint ha_gatherdb::convert_row_to_internal_format(uchar *record,
       }
     }
     (*field)->move_field_offset(-old_ptr);
+    row++;
+    lengths++;
   }
   dbug_tmp_restore_column_map(table->write_set, old_map);
   DBUG_RETURN(0);
@@ -468,6 +616,7 @@ int ha_gatherdb::open(const char *name, int mode, uint test_if_locked)
     DBUG_RETURN(1);
   thr_lock_data_init(&share->lock,&lock,NULL);
   my_init_dynamic_array(&results, sizeof(MYSQL_RES *), 4, 4);
+  my_init_dynamic_array(&connections, sizeof(MYSQL_CONNECT *), 4, 4);
   result_position=0;
   DBUG_RETURN(0);
 }
@@ -492,6 +641,9 @@ int ha_gatherdb::open(const char *name, int mode, uint test_if_locked)
 int ha_gatherdb::close(void)
 {
   DBUG_ENTER("ha_gatherdb::close");
+  reset_shards();
+  delete_dynamic(&results);
+  delete_dynamic(&connections);
   DBUG_RETURN(free_share(share));
 }
 
@@ -512,8 +664,21 @@ int ha_gatherdb::close(void)
 */
 int ha_gatherdb::rnd_init(bool scan)
 {
+  int error;
   DBUG_ENTER("ha_gatherdb::rnd_init");
-  store_result();
+  free_result();
+  if ((error= setup_shards()) || (error= store_result()))
+    DBUG_RETURN(error);
+  if (lst && lst->aggregated)
+    DBUG_RETURN(init_aggregate());
+  DBUG_RETURN(init_merge());
+}
+
+
+int ha_gatherdb::rnd_end()
+{
+  DBUG_ENTER("ha_gatherdb::rnd_end");
+  free_result();
   DBUG_RETURN(0);
 }
 
@@ -524,28 +689,186 @@ int ha_gatherdb::rnd_next_int(uchar *buf)
   DBUG_RETURN(read_next(buf));
 }
 
-void *ha_gatherdb::store_result()
+/*
+  Route the statement and build the shard statements, once per execution:
+  every scan of the table until the statement ends, or another condition
+  is pushed, goes to the same shards. The routing keys are read from the
+  condition pushed for this table, so that in a join only predicates on
+  this table route it, and the read_set, final by the first scan, decides
+  the columns the shards send. Only the conjuncts of a pushed AND prune:
+  a pushed OR, or a routing column under OR or NOT, reads every shard.
+*/
+int ha_gatherdb::setup_shards()
+{
+  uint slot;
+  route_snapshot *routing;
+  DBUG_ENTER("ha_gatherdb::setup_shards");
+  if (lst)
+    DBUG_RETURN(0);
+  /* the snapshot stays pinned until the shard statements are built */
+  routing= rstate->enter(&slot);
+  if (!(lst= new list_sql_tree(ha_thd(), cpool, rcache, pcache, routing,
+                               gatherdb_pool_wait_timeout)))
+  {
+    rstate->leave(slot);
+    DBUG_RETURN(HA_ERR_OUT_OF_MEM);
+  }
+  /* -1 only says there is no condition to route by */
+  (void) lst->list_lex_tree((COND *) pushed);
+  lst->list_lex_merge();
+  if (lst->get_shard_table_info() ||
+      lst->resetup_sql_command(routing ? &routing->tables : NULL, table))
+  {
+    rstate->leave(slot);
+    /* nothing is kept, the next scan routes the statement again */
+    delete lst;
+    lst= 0;
+    my_error(ER_QUERY_ON_FOREIGN_DATA_SOURCE, MYF(0),
+             "cannot route the statement to its shards");
+    DBUG_RETURN(HA_ERR_INTERNAL_ERROR);
+  }
+  rstate->leave(slot);
+  DBUG_RETURN(0);
+}
+
+/* drop the shard statements, the next scan routes the statement again */
+void ha_gatherdb::reset_shards()
+{
+  free_result();
+  delete lst;
+  lst= 0;
+}
+
+/* raise the error a shard failed with for the statement */
+static int shard_error(SHARD_REQUEST *shard, int error)
+{
+  if (shard->message[0])
+    my_error(ER_QUERY_ON_FOREIGN_DATA_SOURCE, MYF(0), shard->message);
+  return error;
+}
+
+/* the error a streamed job stopped with, raised for the statement */
+static int job_error(scatter_job *job)
 {
-  DBUG_ENTER("ha_federated::store_result");
+  if (job->failed >= 0)
+    return shard_error(&job->shards[job->failed], job->error);
+  return job->error;
+}
+
+/*
+  Send every shard statement on a pooled connection to the backend named
+  by the matching shard_info entry. All shards run at once through the
+  scatter pool, and their results are appended to results in completion
+  order. The connections stay checked out in connections until
+  free_result() so a scan never reconnects.
+
+  With gatherdb_stream_results the shards are only started here and run
+  as a pipeline behind next_row(), which returns rows from whichever
+  shard has a batch ready; see scatter_job.
+*/
+int ha_gatherdb::store_result()
+{
+  DBUG_ENTER("ha_gatherdb::store_result");
+  if (!lst || !lst->shard_info.elements)
+    DBUG_RETURN(0);
+  if (!lst->sql_commands)
+    DBUG_RETURN(HA_ERR_OUT_OF_MEM);
+  /* the columns a shard row has; a projection of no field sends a constant */
+  uint width= lst->aggregated ? lst->aggregate_width :
+              lst->projected ? MY_MAX(lst->projection_count, 1) :
+              table->s->fields;
+  scatter_job *scan= new scatter_job(cpool, gatherdb_pool_wait_timeout);
+  if (!scan || scan->init(lst->shard_info.elements, gatherdb_stream_results) ||
+      (scan->use_result &&
+       scan->init_batches(width, gatherdb_fetch_batch_rows,
+                          gatherdb_query_memory_limit)))
+  {
+    delete scan;
+    DBUG_RETURN(HA_ERR_OUT_OF_MEM);
+  }
   char **select_sql=lst->sql_commands;
-  char *sql_command;
-  int idx=0;
-  while(idx<lst->shard_info.elements)
+  List_iterator<CONNECT_PARAM> li(lst->shard_info);
+  CONNECT_PARAM *mcp;
+  for (uint idx= 0; (mcp=li++); idx++)
+  {
+    scan->shards[idx].param= mcp;
+    scan->shards[idx].sql= *select_sql++;
+  }
+  if (scan->use_result)
+  {
+    job= scan;
+    spool->stream(job);
+    DBUG_RETURN(0);
+  }
+  spool->execute(scan);
+
+  int error= 0;
+  for (uint idx= 0; idx < scan->done_count; idx++)
+  {
+    SHARD_REQUEST *shard= &scan->shards[scan->done[idx]];
+    if (shard->connection)
+      (void) insert_dynamic(&connections, (uchar*) &shard->connection);
+    if (shard->result)
+      (void) insert_dynamic(&results, (uchar*) &shard->result);
+    if (shard->error && !error)
+      error= shard_error(shard, shard->error);
+  }
+  delete scan;
+  DBUG_RETURN(error);
+}
+
+
+void ha_gatherdb::free_result()
+{
+  DBUG_ENTER("ha_gatherdb::free_result");
+  MYSQL_RES *result;
+  MYSQL_CONNECT *connection;
+  if (merging)
+  {
+    delete_queue(&merge);
+    my_free(sources);
+    sources= 0;
+    merge_next= 0;
+    merging= false;
+  }
+  delete [] agg_rests;
+  agg_rests= 0;
+  agg_row= 0;
+  agg_rows= agg_index= 0;
+  if (job)
+  {
+    /*
+      stop the pipeline and the shards still sending, as after a LIMIT
+      was reached, then free them like stored ones
+    */
+    job->cancel();
+    job->kill_running();
+    for (uint idx= 0; idx < job->count; idx++)
+    {
+      SHARD_REQUEST *shard= &job->shards[idx];
+      if (shard->connection)
+        (void) insert_dynamic(&connections, (uchar*) &shard->connection);
+      if (shard->result)
+        (void) insert_dynamic(&results, (uchar*) &shard->result);
+    }
+    delete job;
+    job= 0;
+    batch= 0;
+  }
+  for (uint idx= 0; idx < results.elements; idx++)
+  {
+    get_dynamic(&results, (uchar *) &result, idx);
+    mysql_free_result(result);
+  }
+  for (uint idx= 0; idx < connections.elements; idx++)
   {
-	sql_command=*select_sql;
-	MYSQL *sql_mysql=mysql_init(NULL);
-	mysql_real_connect(sql_mysql,"127.0.0.1","root","","",3306,NULL,0);
-	mysql_real_query(sql_mysql,sql_command,strlen(sql_command));
-	MYSQL_RES *result= mysql_store_result(sql_mysql);
-	if (result)
-	{
-		(void) insert_dynamic(&results, (uchar*) &result);
-	}
-	select_sql++;
-	idx++;
-	//mysql_close(sql_mysql);
+    get_dynamic(&connections, (uchar *) &connection, idx);
+    cpool->releaseone(connection);
   }
-  DBUG_RETURN(NULL);
+  reset_dynamic(&results);
+  reset_dynamic(&connections);
+  result_position=0;
+  DBUG_VOID_RETURN;
 }
 
 
@@ -573,35 +896,388 @@ int ha_gatherdb::read_next(uchar *buf)
 {
   int retval;
   MYSQL_ROW row;
+  ulong *lengths;
   DBUG_ENTER("ha_gatherdb::read_next");
 
+  if (merging)
+    DBUG_RETURN(read_merge(buf));
+  if (agg_rests)
+    DBUG_RETURN(read_aggregate(buf));
+
   table->status= STATUS_NOT_FOUND;              // For easier return
- 
-  /* Save current data cursor position. */
+  if ((retval= next_row(&row, &lengths)))
+    DBUG_RETURN(retval);
+  if (!(retval= convert_row_to_internal_format(buf, row, lengths)))
+    table->status= 0;
+  DBUG_RETURN(retval);
+}
+
+
+/*
+  The next shard row of the scan: 0, HA_ERR_END_OF_FILE or an error.
+
+  Stored results are read one after the other. Streamed ones come a batch
+  at a time from whichever shard has one ready, so the first rows are
+  returned while slower shards are still running. A batch is handed back
+  to its shard as soon as it has been read, which leaves row valid until
+  the next call only.
+*/
+int ha_gatherdb::next_row(MYSQL_ROW *row, ulong **lengths)
+{
   MYSQL_RES *result;
-  get_dynamic(&results, (uchar *) &result, result_position);
-  current_position= result->data_cursor;
+  if (job)
+  {
+    for (;;)
+    {
+      if (batch && batch->next(row, lengths))
+        return 0;
+      if (batch)
+        job->release(batch);
+      if (!(batch= job->take()))
+        return job->error ? job_error(job) : HA_ERR_END_OF_FILE;
+    }
+  }
+  while (result_position < (int) results.elements)
+  {
+    get_dynamic(&results, (uchar *) &result, result_position);
+    /* Save current data cursor position. */
+    current_position= result->data_cursor;
+
+    if ((*row= mysql_fetch_row(result)))
+    {
+      *lengths= mysql_fetch_lengths(result);
+      return 0;
+    }
+    result_position++;
+  }
+  return HA_ERR_END_OF_FILE;
+}
 
-  /* Fetch a row, insert it back in a row format. */
-  if (!(row= mysql_fetch_row(result)))
+
+/*
+  Scan of an aggregated statement; see list_sql_tree::_make_aggregation().
+  Sets the range of every field whose SUM is spread over several rows.
+*/
+int ha_gatherdb::init_aggregate()
+{
+  Field **field;
+  DBUG_ENTER("ha_gatherdb::init_aggregate");
+  if (!(agg_rests= new mydb_agg_rest[MY_MAX(table->s->fields, 1)]))
+    DBUG_RETURN(HA_ERR_OUT_OF_MEM);
+  agg_row= 0;
+  agg_rows= agg_index= 0;
+  for (field= table->field; *field; field++)
   {
-	
-	do
-	{
-	  result_position++;
-	  get_dynamic(&results, (uchar *) &result, result_position);
-	  if(!result)DBUG_RETURN(HA_ERR_END_OF_FILE);
-	  current_position= result->data_cursor;
-	  row= mysql_fetch_row(result);
-	}while(!row);
+    mydb_agg_rest *rest= &agg_rests[(*field)->field_index];
+    bool unsigned_flag;
+    if (lst->aggregates[(*field)->field_index].kind != AGG_SUM ||
+        (*field)->result_type() == REAL_RESULT)
+      continue;
+    unsigned_flag= ((Field_num *) *field)->unsigned_flag;
+    if ((*field)->type() == MYSQL_TYPE_NEWDECIMAL)
+    {
+      uint precision= ((Field_new_decimal *) *field)->precision;
+      max_my_decimal(&rest->max, precision, (*field)->decimals());
+      max_my_decimal(&rest->min, precision, (*field)->decimals());
+      rest->min.sign(true);
+    }
+    else
+    {
+      uint bits= 8 * (*field)->pack_length();
+      ulonglong max= bits < 64 ? (1ULL << bits) - 1 : ULONGLONG_MAX;
+      if (!unsigned_flag)
+        max>>= 1;
+      int2my_decimal(E_DEC_FATAL_ERROR, (longlong) max, unsigned_flag,
+                     &rest->max);
+      int2my_decimal(E_DEC_FATAL_ERROR, -(longlong) max - 1, FALSE,
+                     &rest->min);
+    }
+    if (unsigned_flag)
+      my_decimal_set_zero(&rest->min);
   }
-  if(result_position==results.elements)
-    DBUG_RETURN(HA_ERR_END_OF_FILE);
+  DBUG_RETURN(0);
+}
 
-  if (!(retval= convert_row_to_internal_format(buf, row, result)))
-    table->status= 0;
+/*
+  read_next() of an aggregated scan. A shard sends one row of partials
+  for its count matching rows, which become count rows again, without
+  going over the network: every aggregated field holds a value in as
+  many of them as the shard counted, its MIN in the first and its MAX in
+  the others, or its SUM spread over them, a value the field can store
+  at a time. The fields the WHERE clause reads hold the values of one
+  row that matched. COUNT, SUM, AVG, MIN and MAX of the server over these
+  rows then come out as over the rows they stand for. Without a COUNT or
+  AVG to keep right, the rows stop once every MIN, MAX and SUM is in, so
+  a grouped scan costs about a row per group and shard.
+*/
+int ha_gatherdb::read_aggregate(uchar *buf)
+{
+  Field **field;
+  int error;
+  bool more= false;
+  my_ptrdiff_t diff= (my_ptrdiff_t) (buf - table->record[0]);
+  my_bitmap_map *old_map;
+  DBUG_ENTER("ha_gatherdb::read_aggregate");
+
+  table->status= STATUS_NOT_FOUND;
+  while (agg_index == agg_rows)
+  {
+    if ((error= next_row(&agg_row, &agg_lengths)))
+      DBUG_RETURN(error);
+    agg_index= 0;
+    agg_rows= agg_row[0] ? (ha_rows) my_strtoll10(agg_row[0], NULL, &error) : 0;
+    for (field= table->field; *field; field++)
+    {
+      AGG_COLUMN *column= &lst->aggregates[(*field)->field_index];
+      mydb_agg_rest *rest= &agg_rests[(*field)->field_index];
+      uint value= column->value;
+      if (column->kind == AGG_NONE)
+        continue;
+      if (column->kind == AGG_SAMPLE)
+      {
+        rest->count= agg_rows;
+        continue;
+      }
+      rest->count= agg_row[value] ?
+                   (ha_rows) my_strtoll10(agg_row[value], NULL, &error) : 0;
+      rest->current= 0;
+      if (column->kind == AGG_SUM && rest->count &&
+          (*field)->result_type() != REAL_RESULT &&
+          str2my_decimal(E_DEC_FATAL_ERROR, agg_row[value + 1],
+                         agg_lengths[value + 1], &my_charset_bin,
+                         &rest->rest[0]))
+        DBUG_RETURN(HA_ERR_INTERNAL_ERROR);
+    }
+  }
 
-  DBUG_RETURN(retval);
+  old_map= dbug_tmp_use_all_columns(table, table->write_set);
+  for (field= table->field; *field; field++)
+  {
+    AGG_COLUMN *column= &lst->aggregates[(*field)->field_index];
+    mydb_agg_rest *rest= &agg_rests[(*field)->field_index];
+    uint value= column->value;
+    if (column->kind == AGG_NONE)
+      continue;
+    (*field)->move_field_offset(diff);
+    if (agg_index >= rest->count ||
+        (column->kind == AGG_SAMPLE && !agg_row[value]))
+    {
+      (*field)->set_null();
+      (*field)->reset();
+    }
+    else
+    {
+      (*field)->set_notnull();
+      if (column->kind == AGG_SAMPLE)
+        (*field)->store(agg_row[value], agg_lengths[value], &my_charset_bin);
+      else if (column->kind != AGG_SUM)
+      {
+        if (!agg_index && rest->count > 1)
+          more= true;
+        value+= agg_index ? 2 : 1;
+        (*field)->store(agg_row[value], agg_lengths[value], &my_charset_bin);
+      }
+      else if ((*field)->result_type() == REAL_RESULT)
+      {
+        if (agg_index)
+          (*field)->store(0.0);
+        else
+          (*field)->store(agg_row[value + 1], agg_lengths[value + 1],
+                          &my_charset_bin);
+      }
+      else
+      {
+        my_decimal *left= &rest->rest[rest->current], *part= left;
+        if (my_decimal_cmp(left, &rest->max) > 0)
+          part= &rest->max;
+        else if (my_decimal_cmp(left, &rest->min) < 0)
+          part= &rest->min;
+        (*field)->store_decimal(part);
+        my_decimal_sub(E_DEC_FATAL_ERROR, &rest->rest[!rest->current],
+                       left, part);
+        rest->current= !rest->current;
+        if (!my_decimal_is_zero(&rest->rest[rest->current]))
+          more= true;
+      }
+    }
+    (*field)->move_field_offset(-diff);
+  }
+  dbug_tmp_restore_column_map(table->write_set, old_map);
+  if (++agg_index < agg_rows && !lst->counted && !more)
+    agg_index= agg_rows;
+  table->status= 0;
+  DBUG_RETURN(0);
+}
+
+static int merge_cmp(void *arg, uchar *a, uchar *b)
+{
+  return ((ha_gatherdb *) arg)->compare_sources((MERGE_SOURCE *) a,
+                                                (MERGE_SOURCE *) b);
+}
+
+/* order of the current rows of two sources by the ORDER BY fields */
+int ha_gatherdb::compare_sources(MERGE_SOURCE *a, MERGE_SOURCE *b)
+{
+  my_ptrdiff_t a_diff= (my_ptrdiff_t) (a->record - table->record[0]);
+  my_ptrdiff_t b_diff= (my_ptrdiff_t) (b->record - table->record[0]);
+  for (uint idx= 0; idx < merge_keys; idx++)
+  {
+    Field *field= merge_fields[idx];
+    bool a_null= field->is_null(a_diff), b_null= field->is_null(b_diff);
+    int res;
+    if (a_null || b_null)
+      res= a_null == b_null ? 0 : (a_null ? -1 : 1);
+    else
+      res= field->cmp(field->ptr + a_diff, field->ptr + b_diff);
+    if (res)
+      return merge_desc[idx] ? -res : res;
+  }
+  return 0;
+}
+
+/*
+  Every shard statement carries the ORDER BY of the statement, so each
+  result comes back sorted. When that ORDER BY is on fields of this table
+  only, the scan merges the results through a heap of the current row of
+  every shard instead of reading them one after the other, and returns
+  the rows in order.
+
+  A single table SELECT whose LIMIT the server applies to exactly these
+  rows then ends after offset+count rows: none of the rows after them can
+  be among the first ones. The shards still sending are cancelled by
+  free_result().
+*/
+int ha_gatherdb::init_merge()
+{
+  DBUG_ENTER("ha_gatherdb::init_merge");
+  LEX *lex= ha_thd()->lex;
+  SELECT_LEX *select_lex= &lex->select_lex;
+  ORDER *order;
+  uchar *records;
+  uint count= job ? job->count : results.elements;
+  ulong reclength= ALIGN_SIZE(table->s->reclength);
+  int error;
+
+  /* blobs keep their value in the Field, one row at a time */
+  if (count < 2 || table->s->blob_fields || !table->pos_in_table_list ||
+      table->pos_in_table_list->select_lex != select_lex ||
+      select_lex->next_select() || !select_lex->order_list.elements ||
+      select_lex->group_list.elements || select_lex->with_sum_func)
+    DBUG_RETURN(0);
+  for (order= select_lex->order_list.first; order; order= order->next)
+  {
+    Item *item= (*order->item)->real_item();
+    if (item->type() != Item::FIELD_ITEM ||
+        ((Item_field *) item)->field->table != table)
+      DBUG_RETURN(0);
+  }
+  merge_keys= select_lex->order_list.elements;
+  if (!my_multi_malloc(MYF(MY_WME),
+                       &sources, count * sizeof(MERGE_SOURCE),
+                       &merge_fields, merge_keys * sizeof(Field *),
+                       &merge_desc, merge_keys * sizeof(bool),
+                       &records, count * reclength,
+                       NullS))
+    DBUG_RETURN(HA_ERR_OUT_OF_MEM);
+  if (init_queue(&merge, count, 0, 0, merge_cmp, (void *) this))
+  {
+    my_free(sources);
+    sources= 0;
+    DBUG_RETURN(HA_ERR_OUT_OF_MEM);
+  }
+  merge_keys= 0;
+  for (order= select_lex->order_list.first; order; order= order->next)
+  {
+    Item_field *item= (Item_field *) (*order->item)->real_item();
+    merge_fields[merge_keys]= table->field[item->field->field_index];
+    merge_desc[merge_keys++]= !order->asc;
+  }
+  merging= true;
+  merge_next= 0;
+  for (uint idx= 0; idx < count; idx++)
+  {
+    MERGE_SOURCE *source= &sources[idx];
+    source->result= NULL;
+    if (!job)
+      get_dynamic(&results, (uchar *) &source->result, idx);
+    source->shard= idx;
+    source->batch= NULL;
+    source->record= records + idx * reclength;
+    if ((error= merge_fetch(source)) > 0)
+      DBUG_RETURN(error);
+    if (!error)
+      queue_insert(&merge, (uchar *) source);
+  }
+  merge_rows= HA_POS_ERROR;
+  if (lex->sql_command == SQLCOM_SELECT && select_lex->select_limit &&
+      select_lex->table_list.elements == 1 && !select_lex->having &&
+      !(select_lex->options & (SELECT_DISTINCT | OPTION_FOUND_ROWS)))
+  {
+    longlong limit= select_lex->select_limit->val_int();
+    longlong offset= select_lex->offset_limit ?
+                     select_lex->offset_limit->val_int() : 0;
+    if (limit >= 0 && offset >= 0)
+      merge_rows= (ha_rows) limit + (ha_rows) offset;
+  }
+  DBUG_RETURN(0);
+}
+
+/*
+  The next row of source into its record: 0, -1 at the end of the shard,
+  or an error.
+*/
+int ha_gatherdb::merge_fetch(MERGE_SOURCE *source)
+{
+  MYSQL_ROW row;
+  ulong *lengths;
+  if (source->result)
+  {
+    if (!(row= mysql_fetch_row(source->result)))
+      return -1;
+    lengths= mysql_fetch_lengths(source->result);
+  }
+  else
+  {
+    while (!source->batch || !source->batch->next(&row, &lengths))
+    {
+      if (source->batch)
+        job->release(source->batch);
+      if (!(source->batch= job->take_shard(source->shard)))
+        return job->error ? job_error(job) : -1;
+    }
+  }
+  return (int) convert_row_to_internal_format(source->record, row, lengths);
+}
+
+/*
+  read_next() of a merged scan: the smallest current row of all shards.
+  The shard a row came from moves on when the next row is asked for, so
+  the scan reads no further than the rows it returns.
+*/
+int ha_gatherdb::read_merge(uchar *buf)
+{
+  int error;
+  DBUG_ENTER("ha_gatherdb::read_merge");
+
+  table->status= STATUS_NOT_FOUND;
+  if (merge_next)
+  {
+    if ((error= merge_fetch(merge_next)) > 0)
+      DBUG_RETURN(error);
+    if (error)
+      queue_remove(&merge, 0);
+    else
+      queue_replaced(&merge);
+    merge_next= 0;
+  }
+  if (!merge.elements || !merge_rows)
+    DBUG_RETURN(HA_ERR_END_OF_FILE);
+  merge_next= (MERGE_SOURCE *) queue_top(&merge);
+  memcpy(buf, merge_next->record, table->s->reclength);
+  if (merge_rows != HA_POS_ERROR)
+    merge_rows--;
+  table->status= 0;
+  DBUG_RETURN(0);
 }
 
 /**
@@ -724,13 +1400,41 @@ int ha_gatherdb::rnd_pos(uchar *buf, uchar *pos)
 int ha_gatherdb::info(uint flag)
 {
   DBUG_ENTER("ha_gatherdb::info");
-  init_table_map();
-  if(lst!=NULL) free(lst);
-  lst=new list_sql_tree(current_thd);
-  lst->list_lex_tree();
-  lst->list_lex_merge();
-  lst->get_shard_table_info();
-  lst->resetup_sql_command(stm);
+  /* the shards are routed by the first scan, see setup_shards() */
+  DBUG_RETURN(0);
+}
+
+
+/*
+  Keep the condition the optimizer attached to this table to route the
+  next scan by; it is often an OR or a mixed AND/OR tree, see
+  setup_shards() for what of it routes. The shards evaluate the whole
+  WHERE clause, but the server still checks cond on the rows they send.
+*/
+const COND *ha_gatherdb::cond_push(const COND *cond)
+{
+  DBUG_ENTER("ha_gatherdb::cond_push");
+  reset_shards();
+  pushed= cond;
+  DBUG_RETURN(cond);
+}
+
+
+void ha_gatherdb::cond_pop()
+{
+  DBUG_ENTER("ha_gatherdb::cond_pop");
+  reset_shards();
+  pushed= 0;
+  DBUG_VOID_RETURN;
+}
+
+
+/* end of the statement: the next one routes anew */
+int ha_gatherdb::reset()
+{
+  DBUG_ENTER("ha_gatherdb::reset");
+  reset_shards();
+  pushed= 0;
   DBUG_RETURN(0);
 }
 
@@ -846,6 +1550,189 @@ int ha_gatherdb::create(const char *name, TABLE *table_arg,
 struct st_mysql_storage_engine gatherdb_storage_engine=
 { MYSQL_HANDLERTON_INTERFACE_VERSION };
 
+static MYSQL_SYSVAR_UINT(pool_min_connections, gatherdb_pool_min_connections,
+  PLUGIN_VAR_RQCMDARG | PLUGIN_VAR_READONLY,
+  "Connections kept open to each backend by the connection pool",
+  NULL, NULL, MIN_CONNECTIONS, 0, 65535, 0);
+
+static MYSQL_SYSVAR_UINT(pool_max_connections, gatherdb_pool_max_connections,
+  PLUGIN_VAR_RQCMDARG | PLUGIN_VAR_READONLY,
+  "Upper bound of pooled connections to each backend",
+  NULL, NULL, MAX_CONNECTIONS, 1, 65535, 0);
+
+static MYSQL_SYSVAR_UINT(pool_ping_interval, gatherdb_pool_ping_interval,
+  PLUGIN_VAR_RQCMDARG | PLUGIN_VAR_READONLY,
+  "Seconds between health checks of idle pooled connections",
+  NULL, NULL, MYDB_PING_INTERVAL, 1, 3600, 0);
+
+static MYSQL_SYSVAR_UINT(pool_warmup_connections, gatherdb_pool_warmup_connections,
+  PLUGIN_VAR_RQCMDARG | PLUGIN_VAR_READONLY,
+  "Connections opened to each backend in parallel at plugin init",
+  NULL, NULL, MIN_CONNECTIONS, 0, 65535, 0);
+
+static MYSQL_SYSVAR_UINT(connect_timeout, gatherdb_connect_timeout,
+  PLUGIN_VAR_RQCMDARG | PLUGIN_VAR_READONLY,
+  "Seconds to wait for a backend connection to be established",
+  NULL, NULL, MYDB_CONNECT_TIMEOUT, 1, 3600, 0);
+
+static MYSQL_SYSVAR_ULONG(pool_wait_timeout, gatherdb_pool_wait_timeout,
+  PLUGIN_VAR_RQCMDARG,
+  "Milliseconds a session queues for a pooled connection when the backend "
+  "is at gatherdb_pool_max_connections; 0 fails immediately",
+  NULL, NULL, MYDB_POOL_WAIT_TIMEOUT, 0, 3600000, 0);
+
+static MYSQL_SYSVAR_UINT(scatter_threads, gatherdb_scatter_threads,
+  PLUGIN_VAR_RQCMDARG | PLUGIN_VAR_READONLY,
+  "Worker threads that run shard queries concurrently; 0 runs them one "
+  "after another in the session thread",
+  NULL, NULL, MYDB_SCATTER_THREADS, 0, 1024, 0);
+
+static MYSQL_SYSVAR_BOOL(stream_results, gatherdb_stream_results,
+  PLUGIN_VAR_OPCMDARG,
+  "Read shard results unbuffered, a batch at a time, instead of storing "
+  "each of them whole before the first row is returned",
+  NULL, NULL, TRUE);
+
+static MYSQL_SYSVAR_UINT(fetch_batch_rows, gatherdb_fetch_batch_rows,
+  PLUGIN_VAR_RQCMDARG,
+  "Rows a streamed shard hands to the reader per batch",
+  NULL, NULL, MYDB_FETCH_BATCH_ROWS, 1, 1024*1024, 0);
+
+static MYSQL_SYSVAR_ULONG(query_memory_limit, gatherdb_query_memory_limit,
+  PLUGIN_VAR_RQCMDARG,
+  "Bytes of streamed rows a scan buffers at once, split evenly between "
+  "the row batches of its shards",
+  NULL, NULL, MYDB_QUERY_MEMORY_LIMIT, 1024, ULONG_MAX, 0);
+
+static void route_cache_size_update(THD *thd, struct st_mysql_sys_var *var,
+                                    void *var_ptr, const void *save)
+{
+  *(uint *) var_ptr= *(uint *) save;
+  if (rc)
+    rc->max_entries= *(uint *) save;
+}
+
+static void route_cache_ttl_update(THD *thd, struct st_mysql_sys_var *var,
+                                   void *var_ptr, const void *save)
+{
+  *(uint *) var_ptr= *(uint *) save;
+  if (rc)
+    rc->ttl= *(uint *) save;
+}
+
+static void route_cache_negative_ttl_update(THD *thd, struct st_mysql_sys_var *var,
+                                            void *var_ptr, const void *save)
+{
+  *(uint *) var_ptr= *(uint *) save;
+  if (rc)
+    rc->negative_ttl= *(uint *) save;
+}
+
+/* SET GLOBAL gatherdb_route_cache_flush=ON drops every cached route */
+static void route_cache_flush_update(THD *thd, struct st_mysql_sys_var *var,
+                                     void *var_ptr, const void *save)
+{
+  if (*(my_bool *) save && rc)
+    rc->flush();
+}
+
+static MYSQL_SYSVAR_UINT(route_cache_size, gatherdb_route_cache_size,
+  PLUGIN_VAR_RQCMDARG,
+  "Routing values whose train_map rows are cached; 0 disables the cache",
+  NULL, route_cache_size_update, MYDB_ROUTE_CACHE_SIZE, 0, UINT_MAX, 0);
+
+static MYSQL_SYSVAR_UINT(route_cache_ttl, gatherdb_route_cache_ttl,
+  PLUGIN_VAR_RQCMDARG,
+  "Seconds a cached route is used before train_map is read again",
+  NULL, route_cache_ttl_update, MYDB_ROUTE_CACHE_TTL, 1, 86400, 0);
+
+static MYSQL_SYSVAR_UINT(route_cache_negative_ttl, gatherdb_route_cache_negative_ttl,
+  PLUGIN_VAR_RQCMDARG,
+  "Seconds a routing value missing from train_map is remembered as such",
+  NULL, route_cache_negative_ttl_update, MYDB_ROUTE_NEGATIVE_TTL, 0, 86400, 0);
+
+static MYSQL_SYSVAR_BOOL(route_cache_flush, gatherdb_route_cache_flush,
+  PLUGIN_VAR_NOCMDARG,
+  "Set to ON to drop every cached route, e.g. after train_map was changed",
+  NULL, route_cache_flush_update, FALSE);
+
+static void plan_cache_size_update(THD *thd, struct st_mysql_sys_var *var,
+                                   void *var_ptr, const void *save)
+{
+  *(uint *) var_ptr= *(uint *) save;
+  if (pc)
+    pc->max_entries= *(uint *) save;
+}
+
+static MYSQL_SYSVAR_UINT(plan_cache_size, gatherdb_plan_cache_size,
+  PLUGIN_VAR_RQCMDARG,
+  "Statement shapes whose shard statement templates are cached; "
+  "0 disables the cache",
+  NULL, plan_cache_size_update, MYDB_PLAN_CACHE_SIZE, 0, UINT_MAX, 0);
+
+static void route_refresh_interval_update(THD *thd, struct st_mysql_sys_var *var,
+                                          void *var_ptr, const void *save)
+{
+  *(uint *) var_ptr= *(uint *) save;
+  if (rs)
+    rs->set_refresh_interval(*(uint *) save);
+}
+
+static MYSQL_SYSVAR_UINT(route_refresh_interval, gatherdb_route_refresh_interval,
+  PLUGIN_VAR_RQCMDARG,
+  "Seconds between checks of table_map and train_map for changes, which "
+  "are then loaded into a new routing snapshot; 0 disables the checks",
+  NULL, route_refresh_interval_update, MYDB_ROUTE_REFRESH_INTERVAL, 0, 86400, 0);
+
+static MYSQL_SYSVAR_STR(route_snapshot_file, gatherdb_route_snapshot_file,
+  PLUGIN_VAR_RQCMDARG | PLUGIN_VAR_READONLY,
+  "File the routing metadata is saved to after every load and routed "
+  "from at startup, relative to the data directory; empty disables it",
+  NULL, NULL, MYDB_ROUTE_SNAPSHOT_FILE);
+
+static int show_plan_cache_hits(THD *thd, SHOW_VAR *var, char *buff)
+{
+  var->type= SHOW_LONGLONG;
+  var->value= buff;
+  *(longlong *) buff= pc ? my_atomic_load64(&pc->hits) : 0;
+  return 0;
+}
+
+static int show_plan_cache_misses(THD *thd, SHOW_VAR *var, char *buff)
+{
+  var->type= SHOW_LONGLONG;
+  var->value= buff;
+  *(longlong *) buff= pc ? my_atomic_load64(&pc->misses) : 0;
+  return 0;
+}
+
+static SHOW_VAR gatherdb_status_variables[]= {
+  {"Gatherdb_plan_cache_hits", (char *) &show_plan_cache_hits, SHOW_FUNC},
+  {"Gatherdb_plan_cache_misses", (char *) &show_plan_cache_misses, SHOW_FUNC},
+  {NullS, NullS, SHOW_LONG}
+};
+
+static struct st_mysql_sys_var* gatherdb_system_variables[]= {
+  MYSQL_SYSVAR(pool_min_connections),
+  MYSQL_SYSVAR(pool_max_connections),
+  MYSQL_SYSVAR(pool_ping_interval),
+  MYSQL_SYSVAR(pool_warmup_connections),
+  MYSQL_SYSVAR(connect_timeout),
+  MYSQL_SYSVAR(pool_wait_timeout),
+  MYSQL_SYSVAR(scatter_threads),
+  MYSQL_SYSVAR(stream_results),
+  MYSQL_SYSVAR(fetch_batch_rows),
+  MYSQL_SYSVAR(query_memory_limit),
+  MYSQL_SYSVAR(route_cache_size),
+  MYSQL_SYSVAR(route_cache_ttl),
+  MYSQL_SYSVAR(route_cache_negative_ttl),
+  MYSQL_SYSVAR(route_cache_flush),
+  MYSQL_SYSVAR(plan_cache_size),
+  MYSQL_SYSVAR(route_refresh_interval),
+  MYSQL_SYSVAR(route_snapshot_file),
+  NULL
+};
+
 
 mysql_declare_plugin(gatherdb)
 {
@@ -858,8 +1745,8 @@ mysql_declare_plugin(gatherdb)
   gatherdb_init_func,                            /* Plugin Init */
   gatherdb_done_func,                            /* Plugin Deinit */
   0x0001 /* 0.1 */,
-  NULL,                                  /* status variables */
-  NULL,                     /* system variables */
+  gatherdb_status_variables,                     /* status variables */
+  gatherdb_system_variables,                     /* system variables */
   NULL,                                         /* config options */
   0,                                            /* flags */
 }
@@ -35,6 +35,8 @@
 #endif
 
 #include "mysql.h"
+#include "my_atomic.h"
+#include "queues.h"
 #include "strcmp.h"
 #include "mydb_list.h"
 
@@ -50,7 +52,30 @@ typedef struct st_gatherdb_share {
   THR_LOCK lock;
 } GATHERDB_SHARE;
 
-#define MAX_CONNECTIONS 1
+/* default per-backend pool bounds, overridable per line in gather.ini */
+#define MIN_CONNECTIONS 1
+#define MAX_CONNECTIONS 32
+#define MYDB_BACKEND_KEY_LENGTH 256
+/* reconnect backoff of an unhealthy backend: 1s doubling up to 64s */
+#define MYDB_RETRY_MIN_INTERVAL 1
+#define MYDB_RETRY_MAX_SHIFT 6
+#define MYDB_PING_INTERVAL 10
+#define MYDB_CONNECT_TIMEOUT 5
+#define MYDB_WARMUP_MAX_THREADS 256
+#define MYDB_POOL_WAIT_TIMEOUT 1000
+
+#ifdef HAVE_PSI_INTERFACE
+extern PSI_rwlock_key key_rwlock_gatherdb_backends;
+extern PSI_mutex_key key_mutex_connpool, key_mutex_connect_pool_wait;
+extern PSI_mutex_key key_mutex_scatter_pool, key_mutex_scatter_job;
+extern PSI_mutex_key key_mutex_route_cache, key_mutex_route_state, key_mutex_plan_cache;
+extern PSI_cond_key key_cond_connpool, key_cond_connpool_warmup,
+                    key_cond_connect_pool_wait;
+extern PSI_cond_key key_cond_scatter_pool, key_cond_scatter_job;
+extern PSI_cond_key key_cond_route_state;
+extern PSI_thread_key key_thread_connpool_maintenance, key_thread_connpool_warmup;
+extern PSI_thread_key key_thread_scatter_worker, key_thread_route_refresh;
+#endif
 
 
 typedef struct mydb_mysql_instance{
@@ -74,67 +99,319 @@ typedef struct mydb_connect_param{
 static MYSQL_INSTANCE sharding_instance={"127.0.0.1",3306};
 static CONNECT_PARAM sharding_instance_param={&sharding_instance,"root","","tzroute",""};
 
+class connect_pool;
+
 typedef struct mydb_mysql_connect{
 	MYSQL *mysql;
 	bool isused;
 	bool isalive;
+	int32 volatile next_free;	//next slot on the same stack, -1 at the bottom
+	connect_pool *owner;
 }MYSQL_CONNECT;
 
+void check_alive(MYSQL_CONNECT *connection);
+
+/* a session queued for a connection, lives on the waiter's stack */
+typedef struct mydb_pool_waiter{
+	MYSQL_CONNECT *connection;
+	struct mydb_pool_waiter *next;
+}pool_waiter;
+
+/*
+  One backend. Slots live in a fixed array of max_connections entries and
+  sit on one of two lock-free stacks: free_head holds idle open connections,
+  empty_head holds slots with no connection. Both heads pack
+  (aba tag << 32 | slot index + 1) so push/pop is a single CAS.
+*/
 class connect_pool
 {
+private:
+	MYSQL_CONNECT *pop_slot(int64 volatile *head);
+	void push_slot(int64 volatile *head,MYSQL_CONNECT *connection);
+	void discard_slot(MYSQL_CONNECT *connection);
+	MYSQL_CONNECT *pop_idle();
+	void put_idle(MYSQL_CONNECT *connection);
+	MYSQL_CONNECT *grow_one();
+	void dispatch();
 public:
 	CONNECT_PARAM *param;
-	MYSQL_CONNECT connections[MAX_CONNECTIONS];
-	uint free_length;
+	char key[MYDB_BACKEND_KEY_LENGTH];
+	uint key_length;
+	MYSQL_CONNECT *connections;
+	uint min_connections;
+	uint max_connections;
+	uint warmup_connections;
+	uint connect_timeout;
+	int64 volatile free_head;
+	int64 volatile empty_head;
+	int32 volatile free_length;
+	int32 volatile opened;
+	bool volatile healthy;
+	uint fail_count;
+	time_t next_retry;
+	/* FIFO of sessions waiting for a connection, guarded by wait_mutex */
+	mysql_mutex_t wait_mutex;
+	mysql_cond_t wait_cond;
+	pool_waiter *wait_first;
+	pool_waiter *wait_last;
+	int32 volatile waiting;
 	connect_pool *next;
 	connect_pool(){
-		param=(CONNECT_PARAM *)my_malloc(sizeof(CONNECT_PARAM),MYF(0));
+		param=(CONNECT_PARAM *)my_malloc(sizeof(CONNECT_PARAM),MYF(MY_ZEROFILL));
 		param->instance = (MYSQL_INSTANCE *)my_malloc(sizeof(MYSQL_INSTANCE),MYF(0));
 		param->instance->server=0;
 		param->instance->sport=0;
+		connections=0;
+		min_connections=max_connections=0;
+		warmup_connections=connect_timeout=0;
+		free_head=empty_head=0;
+		free_length=opened=0;
+		healthy=true;
+		fail_count=0;
+		next_retry=0;
+		mysql_mutex_init(key_mutex_connect_pool_wait, &wait_mutex, MY_MUTEX_INIT_FAST);
+		mysql_cond_init(key_cond_connect_pool_wait, &wait_cond, NULL);
+		wait_first=wait_last=0;
+		waiting=0;
+		next=0;
 	}
 	~connect_pool(){
+		mysql_cond_destroy(&wait_cond);
+		mysql_mutex_destroy(&wait_mutex);
+		my_free(connections);
 		free(param->instance);
 		free(param);
 	};
+	int init_connections(uint min,uint max);
+	int open_connection(MYSQL_CONNECT *connection);
+	void close_connection(MYSQL_CONNECT *connection);
+	MYSQL_CONNECT *fetchone(ulong wait_timeout);
+	void releaseone(MYSQL_CONNECT *connection);
+	int fill(uint target);
+	int fill_min();
+	int warm_one();
+	void maintain(time_t now);
+	void dispose();
 };
 
+/*
+  Backend registry. backends hashes every connect_pool on
+  "host:port/schema"; lookups only take backends_lock for reading.
+*/
 class connpool
 {
 private:
-
+	HASH backends;
+	mysql_rwlock_t backends_lock;
+	int add_backend(connect_pool *pool);
+	connect_pool *register_backend(CONNECT_PARAM *param);
+	connect_pool *first_backend();
+	int add_route_backend(CONNECT_PARAM *param);
 public:
 	connect_pool* pools;
-	connect_pool *instancepool;
 	uint instances_count;
+	uint min_connections;
+	uint max_connections;
+	uint ping_interval;
+	uint connect_timeout;
+	uint warmup_connections;
+	connect_pool **warmup_tasks;
+	int32 volatile warmup_count;
+	int32 volatile warmup_next;
+	uint warmup_running;
 	mysql_mutex_t mutex;
+	mysql_cond_t cond;
+	mysql_cond_t warmup_cond;
+	pthread_t maintenance_thread;
+	bool maintenance_running;
+	bool stopping;
 	THR_LOCK lock;
 
 	connpool(){};
 	~connpool(){};
 	int init();
 	int init_instances();
-	MYSQL_CONNECT *fetchone(MYSQL_INSTANCE *instance);
+	connect_pool *find_backend(CONNECT_PARAM *param);
+	MYSQL_CONNECT *fetchone(CONNECT_PARAM *param,ulong wait_timeout);
 	void releaseone(MYSQL_CONNECT *connection);
+	int kill_query(MYSQL_CONNECT *connection,CONNECT_PARAM *param);
+	MYSQL_RES *store_query(CONNECT_PARAM *param,const char *sql,uint length,
+		ulong wait_timeout);
 	int realiveconnect(MYSQL_CONNECT *connection,CONNECT_PARAM *param); 
 	int _init_connect();
 	int pool_real_connect();
+	int warmup();
+	void warmup_worker();
+	int start_maintenance(uint interval);
+	void maintenance_loop();
+	void stop_maintenance();
 	int dispose();
 };
 
+#define MYDB_SCATTER_THREADS 16
+#define MYDB_FETCH_BATCH_ROWS 1000
+#define MYDB_QUERY_MEMORY_LIMIT (64*1024*1024)
+#define MYDB_PIPELINE_DEPTH 2
+
+class scatter_job;
+class scatter_pool;
+class row_batch;
+
+typedef struct mydb_scatter_task{
+	scatter_job *job;
+	uint shard;
+	struct mydb_scatter_task *prev;
+	struct mydb_scatter_task *next;
+	bool queued;
+}SCATTER_TASK;
+
+/* one shard statement of a scan and what came back for it */
+typedef struct mydb_shard_request{
+	CONNECT_PARAM *param;
+	char *sql;
+	MYSQL_CONNECT *connection;
+	MYSQL_RES *result;
+	int error;
+	char message[MYSQL_ERRMSG_SIZE];	/* why the shard failed, for the user */
+	row_batch *spare;	/* batches free to be filled */
+	bool eof;
+	bool parked;		/* no spare batch, waits for the reader */
+}SHARD_REQUEST;
+
+/* one sorted shard result of a merged scan and its current row */
+typedef struct mydb_merge_source{
+	MYSQL_RES *result;	/* stored result, NULL when streamed */
+	uint shard;
+	row_batch *batch;	/* streamed: the batch being read */
+	uchar *record;
+}MERGE_SOURCE;
+
+/*
+  Rows copied out of an unbuffered (mysql_use_result) shard stream. A fill
+  stops at max_rows or once max_bytes are used, so the rows a scan holds
+  are bounded by its batches whatever the size of the result.
+*/
+class row_batch
+{
+private:
+	uint fields;
+	uint max_rows;
+	ulong max_bytes;
+	uchar *buffer;
+	ulong buffer_size;
+	ulong used;
+	ulong *offsets;
+	ulong *lengths;
+	char **values;
+	int add_row(MYSQL_ROW row,ulong *row_lengths);
+	int set_fields(uint fields_count);
+public:
+	uint rows;
+	uint read;
+	uint shard;
+	row_batch *link;
+	row_batch(){fields=max_rows=rows=read=shard=0;max_bytes=buffer_size=used=0;
+		buffer=0;offsets=lengths=0;values=0;link=0;};
+	~row_batch(){dispose();};
+	int init(uint fields_count,uint rows_count,ulong bytes);
+	int fill(MYSQL_RES *result);
+	bool next(MYSQL_ROW *row,ulong **row_lengths);
+	void reset(){rows=read=0;used=0;};
+	void dispose();
+};
+
+/*
+  The fan-out of one scan. Every shard becomes a task; done[] records the
+  shard indexes in the order they completed.
+
+  A streamed job (use_result) is a pipeline instead: each shard task
+  fills batches in steps and queues them in ready_first..ready_last for
+  the reader, and stops once all MYDB_PIPELINE_DEPTH of its batches are
+  waiting there. pending counts the steps queued or running, live the
+  shards not yet at the end of their result.
+*/
+class scatter_job
+{
+private:
+	int send(SHARD_REQUEST *shard);
+	void step(SCATTER_TASK *task);
+public:
+	connpool *cpool;
+	scatter_pool *spool;
+	ulong wait_timeout;
+	bool use_result;
+	SHARD_REQUEST *shards;
+	SCATTER_TASK *tasks;
+	uint *done;
+	row_batch *batches;
+	row_batch *ready_first,*ready_last;
+	uint count;
+	uint done_count;
+	uint pending;
+	uint live;
+	int error;
+	int failed;	/* the shard error came from, -1 for none */
+	bool cancelled;
+	mysql_mutex_t mutex;
+	mysql_cond_t cond;
+	scatter_job(connpool *pool,ulong timeout);
+	~scatter_job();
+	int init(uint shards_count,bool unbuffered);
+	int init_batches(uint fields,uint rows,ulong bytes);
+	void run(SCATTER_TASK *task);
+	row_batch *take();
+	row_batch *take_shard(uint shard);
+	void release(row_batch *batch);
+	void cancel();
+	void kill_running();
+};
+
+/*
+  Fixed set of worker threads shared by all sessions. The caller runs one
+  task of its own job and, while it waits, any of its tasks the workers
+  have not picked up yet, so a saturated pool degrades to serial
+  execution instead of stalling.
+*/
+class scatter_pool
+{
+private:
+	SCATTER_TASK *first,*last;
+	pthread_t *threads;
+	uint thread_count;
+	bool stopping;
+	mysql_mutex_t mutex;
+	mysql_cond_t cond;
+	void unlink(SCATTER_TASK *task);
+	void append(SCATTER_TASK *task);
+public:
+	scatter_pool(){first=last=0;threads=0;thread_count=0;stopping=false;};
+	~scatter_pool(){};
+	int start(uint threads_count);
+	void stop();
+	void submit(SCATTER_TASK *task);
+	bool claim(SCATTER_TASK *task);
+	void execute(scatter_job *job);
+	void stream(scatter_job *job);
+	void worker();
+};
+
 #define SPACECHAR ','
 
-class mydb_value_list
+/*
+  The objects a list_sql_tree builds for a statement, and their strings,
+  are allocated on its mem_root and go away with it.
+*/
+class mydb_value_list :public Sql_alloc
 {
 public:
 	char *value;
 	enum Item::Type value_type;
 	mydb_value_list(){value=0;value_type=Item::INT_ITEM;};
-	mydb_value_list(Item *item);
-	mydb_value_list(mydb_value_list *mvl);
+	mydb_value_list(Item *item,MEM_ROOT *root);
+	mydb_value_list(mydb_value_list *mvl,MEM_ROOT *root);
 };
 
-class mydb_schema_table{
+class mydb_schema_table :public Sql_alloc{
 public:
 	char  *schema_name;
 	char  *table_name;
@@ -144,7 +421,7 @@ public:
 };
 
 
-class mydb_field_detail{
+class mydb_field_detail :public Sql_alloc{
 public:
 	mydb_schema_table field_table;
 	char *f_name;
@@ -153,48 +430,485 @@ public:
 	{
 		
 	};
-	mydb_field_detail(Item *item)
-	{
-		field_table.schema_name=(char *)my_malloc(strlen(((Item_field *)item)->field->table->s->db.str)+1,MYF(0));
-		strcpy(field_table.schema_name,((Item_field *)item)->field->table->s->db.str);
-		field_table.table_alias=(char *)my_malloc(strlen(*(((Item_field *)item)->field->table_name))+1,MYF(0));
-		strcpy(field_table.table_alias,*(((Item_field *)item)->field->table_name));
-		field_table.table_name=(char *)my_malloc(strlen(((Item_field *)item)->field->table->alias)+1,MYF(0));
-		strcpy(field_table.table_alias,((Item_field *)item)->field->table->alias);
-		field_table.is_alias_used=((Item_field *)item)->field->table->alias_name_used;
-		f_name=(char *)my_malloc(strlen(item->name)+1,MYF(0));
-		strcpy(f_name,item->name);
-	};
+	mydb_field_detail(Item *item,MEM_ROOT *root);
 };
 
-class mydb_field_cond{
+class mydb_field_cond :public Sql_alloc{
 public:
+	MEM_ROOT *mem_root;
 	mydb_field_detail *field_name;
 	List<mydb_value_list> values;//¼߼value
 	bool isRange;
 	mydb_value_list s_min;//¼between
 	mydb_value_list s_max;
+	Item_func::Functype op;//the comparison the values come from
+	bool negated;//NOT IN, NOT BETWEEN
 
 	int _nodes;
-	mydb_field_cond();
-	mydb_field_cond(Item *field,Item *value);
-	mydb_field_cond(Item *field,Item *minvalue,Item *maxvalue);
-	mydb_field_cond(Item *multilist);
-	mydb_field_cond(mydb_field_cond *mfc);
+	mydb_field_cond(MEM_ROOT *root);
+	mydb_field_cond(MEM_ROOT *root,Item *field,Item *value);
+	mydb_field_cond(MEM_ROOT *root,Item *field,Item *minvalue,Item *maxvalue);
+	mydb_field_cond(MEM_ROOT *root,Item *multilist);
+	mydb_field_cond(MEM_ROOT *root,mydb_field_cond *mfc);
 	void setfield(Item *field);
 	void addvalue(Item *value);	
+	void setop(Item_func *func);
+	/* the values hold every value the field may have, so routing may prune */
+	bool exact()
+	{
+		return !negated&&(op==Item_func::EQ_FUNC||op==Item_func::EQUAL_FUNC||
+			op==Item_func::IN_FUNC||op==Item_func::BETWEEN);
+	};
+};
+
+/*
+  The rows of one routing metadata query, row idx at values+idx*fields.
+  They point into result when read from the routing instance, or into
+  the mapped snapshot file; either has to outlive them.
+*/
+class route_rows
+{
+public:
+	uint fields;
+	uint count;
+	char **values;
+	MYSQL_RES *result;
+	route_rows(){fields=count=0;values=0;result=0;};
+	~route_rows(){dispose();};
+	MYSQL_ROW row(uint idx){return values+idx*fields;};
+	int init(uint fields_count,uint rows_count);
+	int fetch(connpool *pool,ulong wait_timeout,const char *sql,uint length);
+	void dispose();
 };
 
+/* names of the sharded tables in table_map, as a hash set */
 class shard_table_map
 {
 private:
+	HASH tables;
+	bool loaded;
 public:
-	char **table_map;
-	shard_table_map(){table_map=(char **)my_malloc(sizeof(char **),MYF(0));};
-	int init();
+	shard_table_map(){loaded=false;};
+	~shard_table_map(){if(loaded) my_hash_free(&tables);};
+	int init(route_rows *rows);
 	bool table_in_list(const char *table_name);
 };
 
+#define MYDB_ROUTE_KEY_LENGTH 256
+#define MYDB_ROUTE_CACHE_SIZE 65536
+#define MYDB_ROUTE_CACHE_TTL 300
+#define MYDB_ROUTE_NEGATIVE_TTL 30
+
+/* the shard columns of a train_map row */
+typedef struct mydb_route{
+	char *server;
+	uint sport;
+	char *schema;
+	char *prefix;
+}ROUTE;
+
+/* routes of one field=value key, allocated in a single block */
+typedef struct mydb_route_entry{
+	char *key;
+	uint key_length;
+	ROUTE *routes;
+	uint routes_count;	//0 for a value train_map does not know
+	time_t expires;
+	struct mydb_route_entry *prev,*next;	//LRU, most recent first
+}ROUTE_ENTRY;
+
+int add_shard_route(List<CONNECT_PARAM> *shards,MEM_ROOT *root,const ROUTE *route);
+
+#define MYDB_NO_SHARD UINT_MAX
+
+/*
+  A shard of a statement and the routing value, or the part of a routing
+  range, it was chosen for. shard is MYDB_NO_SHARD for a value that no
+  shard holds.
+*/
+typedef struct mydb_shard_key{
+	uint shard;
+	const char *value;	//NULL for a range
+	longlong min;
+	longlong max;
+}SHARD_KEY;
+
+/*
+  What each shard of a statement was chosen for, so its statement can be
+  pruned to those values. usable is cleared once a shard is added that
+  no value accounts for, e.g. from a train_map query on several columns.
+*/
+class shard_keys
+{
+public:
+	DYNAMIC_ARRAY keys;
+	bool usable;
+	shard_keys(){usable=true;my_init_dynamic_array(&keys,sizeof(SHARD_KEY),64,64);};
+	~shard_keys(){delete_dynamic(&keys);};
+	void add(int shard,const char *value);
+	void add_none(const char *value);
+	void add_range(int shard,longlong min,longlong max);
+	void disable(){usable=false;};
+};
+
+/*
+  train_map rows by routing value, so point queries resolve their shards
+  without a round trip to the routing instance. Entries expire after ttl
+  (negative_ttl for values with no row) and the least recently used ones
+  are evicted beyond max_entries. flush() drops everything and bumps
+  version; an insert prepared under an older version is discarded, so a
+  lookup racing with a flush cannot bring old routes back.
+*/
+class route_cache
+{
+private:
+	HASH entries;
+	ROUTE_ENTRY *first,*last;
+	ulonglong version;
+	mysql_mutex_t mutex;
+	void unlink(ROUTE_ENTRY *entry);
+	void remove(ROUTE_ENTRY *entry);
+public:
+	uint max_entries;
+	uint ttl;
+	uint negative_ttl;
+	ulonglong hits,misses;
+	route_cache(){first=last=0;version=0;max_entries=ttl=negative_ttl=0;hits=misses=0;};
+	~route_cache(){};
+	int init();
+	void dispose();
+	ulonglong current_version();
+	int lookup(const char *key,uint length,List<CONNECT_PARAM> *shards,
+		MEM_ROOT *root,shard_keys *keys,const char *value);
+	void insert(const char *key,uint length,ROUTE *routes,uint routes_count,
+		ulonglong prepared_version);
+	void flush();
+};
+
+/* train_map rows from min to max of a routing column all go to route */
+typedef struct mydb_route_interval{
+	longlong min;
+	longlong max;
+	uint route;
+}ROUTE_INTERVAL;
+
+/*
+  Sorted, non-overlapping intervals of one routing column. Runs of
+  consecutive values with the same shard share an interval, and max is
+  non-decreasing, so the first interval of a range is found by binary
+  search. Only integer columns are indexed.
+*/
+class range_index
+{
+public:
+	ROUTE_INTERVAL *intervals;
+	uint intervals_count;
+	bool usable;
+	range_index(){intervals=0;intervals_count=0;usable=false;};
+	int build(route_rows *rows,uint column,uint *route_ids,MEM_ROOT *root);
+	uint first_interval(longlong min);
+};
+
+/*
+  Every train_map row, loaded once, to resolve trainid/packageid ranges
+  without asking the routing instance.
+*/
+class range_router
+{
+private:
+	MEM_ROOT mem_root;
+	ROUTE *routes;
+	uint routes_count;
+	range_index train;
+	range_index package;
+public:
+	range_router(){routes=0;routes_count=0;init_alloc_root(&mem_root,4096,0);};
+	~range_router(){free_root(&mem_root,MYF(0));};
+	int load(route_rows *rows);
+	int lookup(const char *field,const char *min,const char *max,
+		List<CONNECT_PARAM> *shards,MEM_ROOT *root,shard_keys *keys);
+};
+
+#define MYDB_SHARD_RULE "shard_rule"
+#define MYDB_RING_POINTS 64
+
+enum shard_func_type {SHARD_FUNC_MODULO,SHARD_FUNC_HASH,SHARD_FUNC_RANGE};
+
+/* one virtual node of a consistent hash ring */
+typedef struct mydb_ring_point{
+	uint32 hash;
+	uint node;
+}RING_POINT;
+
+/*
+  A table whose rows are placed by a function of one column, so its
+  shards are computed here instead of looked up in train_map. nodes are
+  the shard_rule rows of the table in node order:
+  - modulo: value mod nodes_count picks the node
+  - hash: crc32 of the value on a ring of MYDB_RING_POINTS points per node
+  - range: the first node whose bound is >= value, bounds ascending and
+    a NULL bound for no upper limit
+*/
+class shard_rule
+{
+private:
+	int node_of(const char *value);
+	uint first_bound(longlong value);
+public:
+	char *table_name;
+	uint table_name_length;
+	char *field;
+	enum shard_func_type func;
+	ROUTE *nodes;
+	longlong *bounds;
+	bool *unbounded;
+	uint nodes_count;
+	RING_POINT *ring;
+	uint ring_count;
+	int build_ring(MEM_ROOT *root);
+	void all_nodes(List<CONNECT_PARAM> *shards,MEM_ROOT *root,shard_keys *keys);
+	void route_values(List<mydb_value_list> *values,List<CONNECT_PARAM> *shards,
+		MEM_ROOT *root,shard_keys *keys);
+	void route_range(const char *min,const char *max,List<CONNECT_PARAM> *shards,
+		MEM_ROOT *root,shard_keys *keys);
+};
+
+/* the shard_rule table, one shard_rule per table name */
+class shard_rules
+{
+private:
+	HASH rules;
+	MEM_ROOT mem_root;
+	bool loaded;
+	shard_rule *add_rule(MYSQL_ROW *rows,uint count);
+public:
+	shard_rules(){loaded=false;init_alloc_root(&mem_root,4096,0);};
+	~shard_rules(){if(loaded) my_hash_free(&rules);free_root(&mem_root,MYF(0));};
+	int load(route_rows *rows);
+	shard_rule *find(const char *table_name);
+};
+
+#define MYDB_ROUTE_REFRESH_INTERVAL 30
+#define MYDB_ROUTE_RETRY_INTERVAL 1
+#define MYDB_ROUTE_CHECKSUM_LENGTH 64
+#define MYDB_ROUTE_SNAPSHOT_FILE "gatherdb_route.snap"
+#define MYDB_ROUTE_SNAPSHOT_MAGIC "GDBROUTE"
+#define MYDB_ROUTE_SNAPSHOT_FORMAT 1
+
+/* the metadata queries of a snapshot, in the order they are stored */
+enum route_set_type {ROUTE_SET_TABLES,ROUTE_SET_TRAIN,ROUTE_SET_RULES,ROUTE_SETS};
+
+/*
+  Everything a statement routes with, loaded in one go and never changed
+  afterwards: the sharded table names, the train_map range index and the
+  sharding functions. checksum is what CHECKSUM TABLE reported for the
+  metadata tables just before the load.
+*/
+class route_snapshot
+{
+public:
+	shard_table_map tables;
+	range_router *ranges;
+	shard_rules *rules;
+	ulonglong version;
+	char checksum[MYDB_ROUTE_CHECKSUM_LENGTH];
+	route_snapshot(){ranges=0;rules=0;version=0;checksum[0]=0;};
+	~route_snapshot(){delete ranges;delete rules;};
+	int build(route_rows *sets);
+	int load(connpool *pool,ulong wait_timeout,const char *sum,const char *file);
+	int load_file(const char *file);
+	int save(const char *file,route_rows *sets);
+};
+
+/*
+  The current route_snapshot, replaced as a whole by the refresh thread
+  when the routing metadata changes. Readers never lock: enter() counts
+  the reader in the slot of the current epoch and reads the pointer.
+  publish() swaps the pointer, moves to the next epoch and waits for the
+  readers of the previous one to leave before freeing the old snapshot.
+*/
+class route_state
+{
+private:
+	route_snapshot * volatile current;
+	int32 volatile epoch;
+	int32 volatile readers[2];
+	connpool *cpool;
+	route_cache *rcache;
+	mysql_mutex_t mutex;
+	mysql_cond_t cond;
+	pthread_t refresh_thread;
+	bool refresh_running;
+	bool stopping;
+	/* current was checked against the routing instance, not only the file */
+	bool confirmed;
+	int checksum(char *sum);
+public:
+	uint refresh_interval;
+	ulong wait_timeout;
+	ulonglong reloads;
+	const char *snapshot_file;
+	route_state(){current=0;epoch=0;readers[0]=readers[1]=0;cpool=0;rcache=0;
+		refresh_running=stopping=confirmed=false;refresh_interval=0;wait_timeout=0;
+		reloads=0;snapshot_file=0;};
+	~route_state(){};
+	int init(connpool *pool,route_cache *cache);
+	int load_file();
+	route_snapshot *enter(uint *slot);
+	void leave(uint slot);
+	void publish(route_snapshot *snapshot);
+	int refresh();
+	void set_refresh_interval(uint interval);
+	int start_refresh();
+	void refresh_loop();
+	void stop_refresh();
+	void dispose();
+};
+
+/* a piece of the statement text, from start up to end */
+typedef struct mydb_sql_span{
+	const char *start;
+	const char *end;
+}SQL_SPAN;
+
+#define MYDB_SQL_MAX_DEPTH 64
+
+enum sql_piece_type {SQL_PIECE_TEXT,SQL_PIECE_TABLE,SQL_PIECE_ROUTE,
+	SQL_PIECE_COLUMNS,SQL_PIECE_COLUMNS_END,SQL_PIECE_LIMIT,SQL_PIECE_GROUP,
+	SQL_PIECE_GROUP_END};
+
+/*
+  Text copied as is, a reference to a sharded table (start is its name
+  in the table list), the routing predicate that a shard may replace,
+  the marks around the select list of a statement that may be projected
+  and around its GROUP BY list, or the offset and row count of the
+  outermost LIMIT.
+*/
+typedef struct mydb_sql_piece{
+	enum sql_piece_type type;
+	const char *start;
+	uint length;
+	bool alias;	//a table with no alias of its own gets its name as one
+	bool top;	//a table of the FROM clause of the outermost SELECT
+}SQL_PIECE;
+
+/*
+  A statement cut into what every shard shares and what each shard fills
+  in: the references to sharded tables, the routing predicate and the
+  select list. The table references are those of the parsed table list,
+  found by one pass over the tokens of the statement; render() writes
+  one shard's statement in one more.
+*/
+class sql_template
+{
+public:
+	DYNAMIC_ARRAY pieces;
+	sql_template(){my_init_dynamic_array(&pieces,sizeof(SQL_PIECE),16,16);};
+	~sql_template(){delete_dynamic(&pieces);};
+	int add(enum sql_piece_type type,const char *start,uint length,bool alias,
+		bool top=false);
+	int build(const char *query,List<mydb_schema_table> *tables,shard_table_map *map,
+		const char *current_db,SQL_SPAN *route);
+	bool projects(const char *table_name);
+	int render(String *sql,CONNECT_PARAM *shard,String *route,String *columns,
+		String *group);
+};
+
+/*
+  The shape of a statement: the current database, a NUL, and the
+  statement with every literal (a quoted string or an unsigned integer)
+  as '?'. Statements that differ only in literals share it. position()
+  and offset() convert between offsets in the shape and positions in
+  the statement; between two rewind() calls they must be asked in
+  increasing order.
+*/
+class sql_digest
+{
+private:
+	uint cursor;
+	size_t shift;
+public:
+	String text;
+	uint prefix;	//length of the database part of text
+	const char *query;
+	DYNAMIC_ARRAY literals;	//SQL_SPAN of every literal of query
+	sql_digest(){query=0;prefix=0;cursor=0;shift=0;
+		my_init_dynamic_array(&literals,sizeof(SQL_SPAN),16,16);};
+	~sql_digest(){delete_dynamic(&literals);};
+	int build(const char *statement,const char *db);
+	void rewind(){cursor=0;shift=0;};
+	const char *position(uint offset);
+	uint offset(const char *pos);
+};
+
+#define MYDB_PLAN_CACHE_SIZE 1024
+
+/* a piece of a cached template, at an offset of the statement's shape */
+typedef struct mydb_plan_piece{
+	enum sql_piece_type type;
+	uint offset;
+	uint length;
+	const char *name;	//the table of a table piece
+	bool alias;
+	bool top;
+}PLAN_PIECE;
+
+typedef struct mydb_plan_span{
+	uint start;
+	uint end;
+}PLAN_SPAN;
+
+/* the template of one statement shape, allocated in a single block */
+typedef struct mydb_plan_entry{
+	ulong size;	//of the block, for copying it out of the cache
+	char *key;
+	uint key_length;
+	ulonglong version;	//of the routing snapshot the template was built with
+	PLAN_PIECE *pieces;
+	uint pieces_count;
+	char *route_field;	//the routing predicate was looked for on it, or NULL
+	bool route_range;
+	bool route_found;
+	PLAN_SPAN route;
+	PLAN_SPAN *elements;	//the literals routed by, as list elements or bounds
+	uint elements_count;
+	struct mydb_plan_entry *prev,*next;	//LRU, most recent first
+}PLAN_ENTRY;
+
+/*
+  Shard statement templates by statement shape. A hit binds the cached
+  pieces and routing predicate to the literals of the statement at hand
+  instead of searching its text again. A template is only used with the
+  routing snapshot it was built with, since that decides which tables
+  are sharded. The least recently used ones are evicted beyond
+  max_entries. A hit is bound from a copy of the entry, outside the
+  mutex.
+*/
+class plan_cache
+{
+private:
+	HASH entries;
+	PLAN_ENTRY *first,*last;
+	mysql_mutex_t mutex;
+	void unlink(PLAN_ENTRY *entry);
+	void remove(PLAN_ENTRY *entry);
+	PLAN_ENTRY *copy(PLAN_ENTRY *entry);
+	int bind(PLAN_ENTRY *entry,sql_digest *digest,List<mydb_schema_table> *tables,
+		sql_template *shard_sql,SQL_SPAN *route,DYNAMIC_ARRAY *elements);
+public:
+	uint max_entries;
+	volatile int64 hits,misses;
+	plan_cache(){first=last=0;max_entries=0;hits=misses=0;};
+	~plan_cache(){};
+	int init();
+	void dispose();
+	int lookup(sql_digest *digest,ulonglong version,const char *field,bool range,
+		List<mydb_schema_table> *tables,sql_template *shard_sql,SQL_SPAN *route,
+		DYNAMIC_ARRAY *elements);
+	void insert(sql_digest *digest,ulonglong version,const char *field,bool range,
+		sql_template *shard_sql,SQL_SPAN *route,DYNAMIC_ARRAY *elements);
+};
+
 class mydb_shard_table_map{
 public:
 	mydb_schema_table orgtable;
@@ -202,6 +916,21 @@ public:
 	mydb_shard_table_map(){};
 };
 
+/*
+  How a field of an aggregated scan is rebuilt from the partial aggregates
+  of a shard; see list_sql_tree::_make_aggregation(). AGG_COUNT is only
+  counted and is sent like AGG_RANGE.
+*/
+enum agg_column_kind{AGG_NONE,AGG_COUNT,AGG_SUM,AGG_RANGE,AGG_SAMPLE};
+
+typedef struct mydb_agg_column{
+	enum agg_column_kind kind;
+	uint value;	/* its first column in the shard row */
+}AGG_COLUMN;
+
+/* block of the statement arena; a long IN list takes a few of them */
+#define MYDB_ARENA_BLOCK_SIZE 8192
+
 class list_sql_tree
 {
 private:
@@ -211,11 +940,13 @@ private:
 	List<mydb_field_cond> fieldlist;
 	List<mydb_field_cond> mergelist;
 	List<char> where_cond;
-	//MEM_ROOT mem_root;
+	/* everything built for the statement, freed at once with the tree */
+	MEM_ROOT mem_root;
 	void _move_node(Item **conds,int nodes);
-	void _add_fields_2(Item *field,Item *value);
-	void _add_fields_3(Item *field,Item *minvalue,Item *maxvalue);
-	int _add_fields_n(Item *multilist);
+	void _add_fields_2(Item_func *func,Item *field,Item *value);
+	void _add_fields_3(Item_func *func,Item *field,Item *minvalue,Item *maxvalue);
+	int _add_fields_n(Item_func *multilist);
+	void _add_fields_inexact(Item *cond);
 	mydb_field_cond* _is_filed_in_list(mydb_field_cond *fl);
 	void _merge_field_cond(mydb_field_cond* mfiled,mydb_field_cond* filed);
 	int _list_sql_table_list();
@@ -225,27 +956,67 @@ private:
 	int _list_field_cond();
 	char *_make_where_str();
 	int _make_shard_command(char *result);
+	mydb_field_cond *_route_single_cond(const char **field);
+	int _route_cached(mydb_field_cond *mfc,const char *field);
+	int _route_rule();
+	const char *_route_field();
+	String *_prune_parts(DYNAMIC_ARRAY *elements);
+	int _make_projection(TABLE *table,String *columns);
+	int _make_aggregation(TABLE *table,String *columns,String *group);
+	connpool *cpool;
+	route_cache *rcache;
+	plan_cache *pcache;
+	route_snapshot *routing;
+	ulong wait_timeout;
+	/* the condition shards were chosen by, and for which of its values */
+	mydb_field_cond *route_cond;
+	shard_keys route_keys;
 public:
 	char **sql_commands;
 	List<CONNECT_PARAM> shard_info;
+	/*
+	  The shard statements select only these fields of the table, by
+	  field_index in increasing order, when projected is set.
+	*/
+	bool projected;
+	uint *projection;
+	uint projection_count;
+	/*
+	  The shard statements send one row of partial aggregates, of
+	  aggregate_width columns, which the scan turns back into rows the
+	  aggregates of the statement give the same result on; one
+	  AGG_COLUMN per field of the table. Unless counted, the statement
+	  has no COUNT or AVG and a row of partials needs only the rows its
+	  MIN, MAX and SUM values fit in.
+	*/
+	bool aggregated;
+	bool counted;
+	AGG_COLUMN *aggregates;
+	uint aggregate_width;
 	list_sql_tree(){
-		//init_alloc_root(&mem_root,256,0);
+		cpool=0;rcache=0;pcache=0;routing=0;wait_timeout=0;route_cond=0;sql_commands=0;
+		projected=false;projection=0;projection_count=0;
+		aggregated=false;counted=false;aggregates=0;aggregate_width=0;
+		init_alloc_root(&mem_root,MYDB_ARENA_BLOCK_SIZE,0);
 	};
-	list_sql_tree(THD *thd){
+	list_sql_tree(THD *thd,connpool *pool,route_cache *cache,plan_cache *plans,
+		route_snapshot *snapshot,ulong timeout){
 		list_thd=thd;_query=list_thd->query();
-		//init_alloc_root(&mem_root,256,0);
+		cpool=pool;rcache=cache;pcache=plans;routing=snapshot;wait_timeout=timeout;route_cond=0;
+		sql_commands=0;
+		projected=false;projection=0;projection_count=0;
+		aggregated=false;counted=false;aggregates=0;aggregate_width=0;
+		init_alloc_root(&mem_root,MYDB_ARENA_BLOCK_SIZE,0);
 	};
 	~list_sql_tree(){
-		//free_root(&mem_root,MYF(0));
+		free_root(&mem_root,MYF(0));
 	};
-	int list_lex_tree();
+	int list_lex_tree(COND *cond);
 	int list_lex_merge();
 	int get_shard_table_info();
-	int resetup_sql_command(shard_table_map *stm1);
+	int resetup_sql_command(shard_table_map *stm1,TABLE *table);
 };
 
-static shard_table_map *stm;
-static	MYSQL *mysql;
 /** @brief
   Class definition for the storage engine
 */
@@ -259,19 +1030,70 @@ class ha_gatherdb: public handler
     Array of all stored results we get during a query execution.
   */
   DYNAMIC_ARRAY results;
+  /**
+    Pooled connections checked out for the current scan; returned to
+    connpool by free_result().
+  */
+  DYNAMIC_ARRAY connections;
+  /**
+    The pipeline of a streamed scan and the batch being read from it;
+    see gatherdb_stream_results.
+  */
+  scatter_job *job;
+  row_batch *batch;
+  /**
+    Merge of the shard results by the ORDER BY they were sorted by: a
+    heap of sources, one per shard; see init_merge().
+  */
+  QUEUE merge;
+  MERGE_SOURCE *sources;
+  MERGE_SOURCE *merge_next;	///< source whose row was returned last
+  Field **merge_fields;
+  bool *merge_desc;
+  uint merge_keys;
+  ha_rows merge_rows;		///< rows left to return, HA_POS_ERROR for all
+  bool merging;
+  /**
+    Aggregated scan: the shard row of partials being turned into rows,
+    how many it stands for and the next one; see read_aggregate().
+  */
+  MYSQL_ROW agg_row;
+  ulong *agg_lengths;
+  ha_rows agg_rows;
+  ha_rows agg_index;
+  struct mydb_agg_rest *agg_rests;
+  /**
+    The condition the optimizer pushed for this table, which the shards
+    of the next scan are routed by; see setup_shards().
+  */
+  const COND *pushed;
   THD *thd;//current_thd
   list_sql_tree *lst;
   connpool *cpool;
+  scatter_pool *spool;
+  route_cache *rcache;
+  plan_cache *pcache;
+  route_state *rstate;
 private:
 	uint convert_row_to_internal_format(uchar *record,
                                                   MYSQL_ROW row,
-                                                  MYSQL_RES *result);
+                                                  ulong *lengths);
 	int read_next(uchar *buf);
+	int next_row(MYSQL_ROW *row, ulong **lengths);
+	int init_aggregate();
+	int read_aggregate(uchar *buf);
+	int init_merge();
+	int merge_fetch(MERGE_SOURCE *source);
+	int read_merge(uchar *buf);
 	int rnd_next_int(uchar *buf);
-	void *ha_gatherdb::store_result();
+	int setup_shards();
+	void reset_shards();
+	int store_result();
+	void free_result();
 public:
 	ha_gatherdb(handlerton *hton, TABLE_SHARE *table_arg);
 	~ha_gatherdb(){ }
+	int compare_sources(MERGE_SOURCE *a, MERGE_SOURCE *b);
 
   /** @brief
     The name that will be used for display purposes.
@@ -341,11 +1163,15 @@ public:
   */
 
 	int rnd_init(bool scan);                                      //required
+	int rnd_end();
 	int rnd_next(uchar *buf);                                     ///< required
 	int rnd_pos(uchar *buf, uchar *pos);                          ///< required
 	void position(const uchar *record);                           ///< required
 	int info(uint);                                               ///< required
 	int external_lock(THD *thd, int lock_type);                   ///< required
+	int reset();
+	const COND *cond_push(const COND *cond);
+	void cond_pop();
 
 	int create(const char *name, TABLE *form,
 				HA_CREATE_INFO *create_info);                      ///< required
@@ -0,0 +1,252 @@
+#define MYSQL_SERVER 1
+#include "sql_class.h"
+#include "ha_gatherdb.h"
+
+static uchar* plan_get_key(PLAN_ENTRY *entry, size_t *length,
+                             my_bool not_used __attribute__((unused)))
+{
+	*length=entry->key_length;
+	return (uchar*) entry->key;
+}
+
+static void plan_free(PLAN_ENTRY *entry)
+{
+	my_free(entry);
+}
+
+int plan_cache::init()
+{
+	DBUG_ENTER("plan_cache::init");
+	mysql_mutex_init(key_mutex_plan_cache, &mutex, MY_MUTEX_INIT_FAST);
+	if(my_hash_init(&entries,&my_charset_bin,256,0,0,
+		(my_hash_get_key) plan_get_key,(my_hash_free_key) plan_free,HASH_UNIQUE))
+		DBUG_RETURN(1);
+	DBUG_RETURN(0);
+}
+
+void plan_cache::dispose()
+{
+	my_hash_free(&entries);
+	first=last=0;
+	mysql_mutex_destroy(&mutex);
+}
+
+/* mutex held */
+void plan_cache::unlink(PLAN_ENTRY *entry)
+{
+	if(entry->prev) entry->prev->next=entry->next;
+	else first=entry->next;
+	if(entry->next) entry->next->prev=entry->prev;
+	else last=entry->prev;
+}
+
+/* mutex held, frees entry */
+void plan_cache::remove(PLAN_ENTRY *entry)
+{
+	unlink(entry);
+	my_hash_delete(&entries,(uchar *)entry);
+}
+
+/* mutex held. entry in a block of its own, the caller frees it */
+PLAN_ENTRY *plan_cache::copy(PLAN_ENTRY *entry)
+{
+	PLAN_ENTRY *result;
+	my_ptrdiff_t diff;
+	if(!(result=(PLAN_ENTRY *)my_malloc(entry->size,MYF(MY_WME))))
+		return NULL;
+	memcpy(result,entry,entry->size);
+	diff=(char *)result-(char *)entry;
+	result->key+=diff;
+	result->pieces=(PLAN_PIECE *)((char *)result->pieces+diff);
+	result->elements=(PLAN_SPAN *)((char *)result->elements+diff);
+	if(result->route_field)
+		result->route_field+=diff;
+	for(uint idx=0;idx<result->pieces_count;idx++)
+	{
+		if(result->pieces[idx].name)
+			result->pieces[idx].name+=diff;
+	}
+	result->prev=result->next=NULL;
+	return result;
+}
+
+/*
+  The pieces of entry over the statement of digest, with the tables of
+  its table list. Fails when a table is not in tables.
+*/
+int plan_cache::bind(PLAN_ENTRY *entry,sql_digest *digest,List<mydb_schema_table> *tables,
+	sql_template *shard_sql,SQL_SPAN *route,DYNAMIC_ARRAY *elements)
+{
+	reset_dynamic(&shard_sql->pieces);
+	digest->rewind();
+	for(uint idx=0;idx<entry->pieces_count;idx++)
+	{
+		PLAN_PIECE *piece=&entry->pieces[idx];
+		if(piece->type==SQL_PIECE_TABLE)
+		{
+			List_iterator<mydb_schema_table> li(*tables);
+			mydb_schema_table *mst;
+			while((mst=li++)&&strcmp(mst->table_name,piece->name))
+				;
+			if(!mst||shard_sql->add(SQL_PIECE_TABLE,mst->table_name,
+				(uint)strlen(mst->table_name),piece->alias,piece->top))
+				return 1;
+			continue;
+		}
+		const char *start=digest->position(piece->offset);
+		const char *end=digest->position(piece->offset+piece->length);
+		if(shard_sql->add(piece->type,start,(uint)(end-start),false))
+			return 1;
+	}
+	if(!entry->route_found)
+		return 0;
+	reset_dynamic(elements);
+	digest->rewind();
+	route->start=digest->position(entry->route.start);
+	for(uint idx=0;idx<entry->elements_count;idx++)
+	{
+		SQL_SPAN element;
+		element.start=digest->position(entry->elements[idx].start);
+		element.end=digest->position(entry->elements[idx].end);
+		if(insert_dynamic(elements,(uchar *)&element))
+			return 1;
+	}
+	route->end=digest->position(entry->route.end);
+	return 0;
+}
+
+/*
+  Bind the template cached for the shape of digest to its statement.
+  field is the column the routing predicate is wanted for, NULL for
+  none; a template that looked for another one is not used. Returns -1
+  when nothing usable is cached, 1 when the routing predicate was found
+  (route and elements set), 0 when it was not or was not wanted.
+*/
+int plan_cache::lookup(sql_digest *digest,ulonglong version,const char *field,bool range,
+	List<mydb_schema_table> *tables,sql_template *shard_sql,SQL_SPAN *route,
+	DYNAMIC_ARRAY *elements)
+{
+	PLAN_ENTRY *entry,*found=NULL;
+	int res=-1;
+	mysql_mutex_lock(&mutex);
+	if((entry=(PLAN_ENTRY *)my_hash_search(&entries,(uchar *)digest->text.ptr(),
+		digest->text.length())))
+	{
+		if(entry->version!=version)
+			remove(entry);
+		else if(!field||(entry->route_field&&!strcmp(entry->route_field,field)&&
+			entry->route_range==range))
+		{
+			found=copy(entry);
+			unlink(entry);
+			entry->prev=NULL;
+			entry->next=first;
+			if(first) first->prev=entry;
+			else last=entry;
+			first=entry;
+		}
+	}
+	mysql_mutex_unlock(&mutex);
+	if(found)
+	{
+		if(!bind(found,digest,tables,shard_sql,route,elements))
+			res=field&&found->route_found;
+		my_free(found);
+	}
+	my_atomic_add64(res<0?&misses:&hits,1);
+	return res;
+}
+
+/*
+  Cache shard_sql, built for the statement of digest, under its shape.
+  route and elements are the routing predicate found on field, route is
+  NULL when it was not found.
+*/
+void plan_cache::insert(sql_digest *digest,ulonglong version,const char *field,bool range,
+	sql_template *shard_sql,SQL_SPAN *route,DYNAMIC_ARRAY *elements)
+{
+	PLAN_ENTRY *entry,*old;
+	uint length=digest->text.length(),elements_count=route?elements->elements:0;
+	uint pieces_count=shard_sql->pieces.elements,idx;
+	ulong size=ALIGN_SIZE(sizeof(PLAN_ENTRY))+ALIGN_SIZE(pieces_count*sizeof(PLAN_PIECE))+
+		ALIGN_SIZE(elements_count*sizeof(PLAN_SPAN))+length+1+(field?strlen(field)+1:0);
+	char *pos;
+	if(!max_entries)
+		return;
+	for(idx=0;idx<pieces_count;idx++)
+	{
+		SQL_PIECE *piece=(SQL_PIECE *)dynamic_array_ptr(&shard_sql->pieces,idx);
+		if(piece->type==SQL_PIECE_TABLE)
+			size+=piece->length+1;
+	}
+	if(!(entry=(PLAN_ENTRY *)my_malloc(size,MYF(MY_WME))))
+		return;
+	entry->size=size;
+	entry->pieces=(PLAN_PIECE *)((char *)entry+ALIGN_SIZE(sizeof(PLAN_ENTRY)));
+	entry->elements=(PLAN_SPAN *)((char *)entry->pieces+ALIGN_SIZE(pieces_count*sizeof(PLAN_PIECE)));
+	pos=(char *)entry->elements+ALIGN_SIZE(elements_count*sizeof(PLAN_SPAN));
+	entry->key=pos;
+	entry->key_length=length;
+	memcpy(pos,digest->text.ptr(),length);
+	pos[length]=0;
+	pos+=length+1;
+	entry->route_field=NULL;
+	if(field)
+	{
+		entry->route_field=pos;
+		pos=strmov(pos,field)+1;
+	}
+	entry->version=version;
+	entry->route_range=range;
+	digest->rewind();
+	for(idx=0;idx<pieces_count;idx++)
+	{
+		SQL_PIECE *piece=(SQL_PIECE *)dynamic_array_ptr(&shard_sql->pieces,idx);
+		PLAN_PIECE *cached=&entry->pieces[idx];
+		cached->type=piece->type;
+		cached->alias=piece->alias;
+		cached->top=piece->top;
+		cached->name=NULL;
+		if(piece->type==SQL_PIECE_TABLE)
+		{
+			cached->offset=cached->length=0;
+			cached->name=pos;
+			pos=strmake(pos,piece->start,piece->length)+1;
+			continue;
+		}
+		cached->offset=digest->offset(piece->start);
+		cached->length=digest->offset(piece->start+piece->length)-cached->offset;
+	}
+	entry->pieces_count=pieces_count;
+	entry->route_found=route!=NULL;
+	entry->route.start=entry->route.end=0;
+	if(route)
+	{
+		digest->rewind();
+		entry->route.start=digest->offset(route->start);
+		for(idx=0;idx<elements_count;idx++)
+		{
+			SQL_SPAN *element=(SQL_SPAN *)dynamic_array_ptr(elements,idx);
+			entry->elements[idx].start=digest->offset(element->start);
+			entry->elements[idx].end=digest->offset(element->end);
+		}
+		entry->route.end=digest->offset(route->end);
+	}
+	entry->elements_count=elements_count;
+	mysql_mutex_lock(&mutex);
+	if((old=(PLAN_ENTRY *)my_hash_search(&entries,(uchar *)entry->key,length)))
+		remove(old);
+	while(last&&entries.records>=max_entries)
+		remove(last);
+	if(my_hash_insert(&entries,(uchar *)entry))
+		my_free(entry);
+	else
+	{
+		entry->prev=NULL;
+		entry->next=first;
+		if(first) first->prev=entry;
+		else last=entry;
+		first=entry;
+	}
+	mysql_mutex_unlock(&mutex);
+}
@@ -0,0 +1,453 @@
+#define MYSQL_SERVER 1
+#include "sql_class.h"
+#include "ha_gatherdb.h"
+
+static uchar* route_get_key(ROUTE_ENTRY *entry, size_t *length,
+                             my_bool not_used __attribute__((unused)))
+{
+	*length=entry->key_length;
+	return (uchar*) entry->key;
+}
+
+static void route_free(ROUTE_ENTRY *entry)
+{
+	my_free(entry);
+}
+
+/*
+  Append the shard of route to shards unless the same backend and table
+  prefix is already there; the values of one statement often share a
+  shard. The new shard, and its node in shards, come from root. Returns
+  the position of the shard in shards, -1 when out of memory.
+*/
+int add_shard_route(List<CONNECT_PARAM> *shards,MEM_ROOT *root,const ROUTE *route)
+{
+	List_iterator<CONNECT_PARAM> li(*shards);
+	CONNECT_PARAM *mcp;
+	MYSQL_INSTANCE *instance;
+	char *server,*schema,*prefix;
+	int idx;
+	for(idx=0;(mcp=li++);idx++)
+	{
+		if(mcp->instance->sport==route->sport&&
+			!strcmp(mcp->instance->server,route->server)&&
+			!strcmp(mcp->schema,route->schema)&&
+			!strcmp(mcp->table_name,route->prefix))
+			return idx;
+	}
+	if(!multi_alloc_root(root,
+		&mcp,sizeof(CONNECT_PARAM),
+		&instance,sizeof(MYSQL_INSTANCE),
+		&server,strlen(route->server)+1,
+		&schema,strlen(route->schema)+1,
+		&prefix,strlen(route->prefix)+1,
+		NullS))
+		return -1;
+	bzero(mcp,sizeof(CONNECT_PARAM));
+	bzero(instance,sizeof(MYSQL_INSTANCE));
+	strmov(server,route->server);
+	strmov(schema,route->schema);
+	strmov(prefix,route->prefix);
+	mcp->instance=instance;
+	instance->server=server;
+	instance->sport=route->sport;
+	mcp->schema=schema;
+	mcp->table_name=prefix;
+	if(shards->push_back(mcp,root))
+		return -1;
+	return idx;
+}
+
+void shard_keys::add(int shard,const char *value)
+{
+	SHARD_KEY key;
+	if(shard<0)
+	{
+		usable=false;
+		return;
+	}
+	key.shard=(uint) shard;
+	key.value=value;
+	key.min=key.max=0;
+	if(insert_dynamic(&keys,(uchar *)&key))
+		usable=false;
+}
+
+void shard_keys::add_none(const char *value)
+{
+	SHARD_KEY key;
+	key.shard=MYDB_NO_SHARD;
+	key.value=value;
+	key.min=key.max=0;
+	if(insert_dynamic(&keys,(uchar *)&key))
+		usable=false;
+}
+
+void shard_keys::add_range(int shard,longlong min,longlong max)
+{
+	SHARD_KEY key;
+	if(shard<0)
+	{
+		usable=false;
+		return;
+	}
+	key.shard=(uint) shard;
+	key.value=NULL;
+	key.min=min;
+	key.max=max;
+	if(insert_dynamic(&keys,(uchar *)&key))
+		usable=false;
+}
+
+int route_cache::init()
+{
+	DBUG_ENTER("route_cache::init");
+	mysql_mutex_init(key_mutex_route_cache, &mutex, MY_MUTEX_INIT_FAST);
+	if(my_hash_init(&entries,&my_charset_bin,1024,0,0,
+		(my_hash_get_key) route_get_key,(my_hash_free_key) route_free,HASH_UNIQUE))
+		DBUG_RETURN(1);
+	DBUG_RETURN(0);
+}
+
+void route_cache::dispose()
+{
+	my_hash_free(&entries);
+	first=last=0;
+	mysql_mutex_destroy(&mutex);
+}
+
+ulonglong route_cache::current_version()
+{
+	ulonglong current;
+	mysql_mutex_lock(&mutex);
+	current=version;
+	mysql_mutex_unlock(&mutex);
+	return current;
+}
+
+/* mutex held */
+void route_cache::unlink(ROUTE_ENTRY *entry)
+{
+	if(entry->prev) entry->prev->next=entry->next;
+	else first=entry->next;
+	if(entry->next) entry->next->prev=entry->prev;
+	else last=entry->prev;
+}
+
+/* mutex held, frees entry */
+void route_cache::remove(ROUTE_ENTRY *entry)
+{
+	unlink(entry);
+	my_hash_delete(&entries,(uchar *)entry);
+}
+
+/*
+  Add the shards cached for key to shards, and to keys as those of value.
+  Returns -1 when key is not cached or has expired, otherwise the number
+  of routes of key, 0 for a value train_map does not know.
+*/
+int route_cache::lookup(const char *key,uint length,List<CONNECT_PARAM> *shards,
+	MEM_ROOT *root,shard_keys *keys,const char *value)
+{
+	ROUTE_ENTRY *entry;
+	int res=-1;
+	mysql_mutex_lock(&mutex);
+	if((entry=(ROUTE_ENTRY *)my_hash_search(&entries,(uchar *)key,length)))
+	{
+		if(entry->expires<=my_time(0))
+			remove(entry);
+		else
+		{
+			for(uint idx=0;idx<entry->routes_count;idx++)
+				keys->add(add_shard_route(shards,root,&entry->routes[idx]),value);
+			if(!entry->routes_count)
+				keys->add_none(value);
+			res=entry->routes_count;
+			unlink(entry);
+			entry->prev=NULL;
+			entry->next=first;
+			if(first) first->prev=entry;
+			else last=entry;
+			first=entry;
+		}
+	}
+	if(res<0) misses++;
+	else hits++;
+	mysql_mutex_unlock(&mutex);
+	return res;
+}
+
+/*
+  Cache a copy of routes under key. prepared_version is current_version()
+  from before the routes were read from train_map.
+*/
+void route_cache::insert(const char *key,uint length,ROUTE *routes,uint routes_count,
+	ulonglong prepared_version)
+{
+	ROUTE_ENTRY *entry,*old;
+	ulong size=ALIGN_SIZE(sizeof(ROUTE_ENTRY))+ALIGN_SIZE(routes_count*sizeof(ROUTE))+length+1;
+	uint idx;
+	char *pos;
+	if(!max_entries)
+		return;
+	for(idx=0;idx<routes_count;idx++)
+		size+=strlen(routes[idx].server)+strlen(routes[idx].schema)+strlen(routes[idx].prefix)+3;
+	if(!(entry=(ROUTE_ENTRY *)my_malloc(size,MYF(MY_WME))))
+		return;
+	entry->routes=(ROUTE *)((char *)entry+ALIGN_SIZE(sizeof(ROUTE_ENTRY)));
+	pos=(char *)entry->routes+ALIGN_SIZE(routes_count*sizeof(ROUTE));
+	entry->key=pos;
+	entry->key_length=length;
+	memcpy(pos,key,length);
+	pos[length]=0;
+	pos+=length+1;
+	for(idx=0;idx<routes_count;idx++)
+	{
+		ROUTE *route=&entry->routes[idx];
+		route->sport=routes[idx].sport;
+		route->server=pos;
+		pos=strmov(pos,routes[idx].server)+1;
+		route->schema=pos;
+		pos=strmov(pos,routes[idx].schema)+1;
+		route->prefix=pos;
+		pos=strmov(pos,routes[idx].prefix)+1;
+	}
+	entry->routes_count=routes_count;
+	entry->expires=my_time(0)+(routes_count?ttl:negative_ttl);
+	mysql_mutex_lock(&mutex);
+	if(version!=prepared_version)
+	{
+		mysql_mutex_unlock(&mutex);
+		my_free(entry);
+		return;
+	}
+	if((old=(ROUTE_ENTRY *)my_hash_search(&entries,(uchar *)key,length)))
+		remove(old);
+	while(last&&entries.records>=max_entries)
+		remove(last);
+	if(my_hash_insert(&entries,(uchar *)entry))
+		my_free(entry);
+	else
+	{
+		entry->prev=NULL;
+		entry->next=first;
+		if(first) first->prev=entry;
+		else last=entry;
+		first=entry;
+	}
+	mysql_mutex_unlock(&mutex);
+}
+
+void route_cache::flush()
+{
+	mysql_mutex_lock(&mutex);
+	version++;
+	my_hash_reset(&entries);
+	first=last=0;
+	mysql_mutex_unlock(&mutex);
+}
+
+typedef struct mydb_route_value{
+	longlong value;
+	uint route;
+}ROUTE_VALUE;
+
+static int route_value_cmp(const void *a,const void *b)
+{
+	const ROUTE_VALUE *x=(const ROUTE_VALUE *)a,*y=(const ROUTE_VALUE *)b;
+	if(x->value!=y->value)
+		return x->value<y->value?-1:1;
+	return x->route<y->route?-1:(x->route>y->route?1:0);
+}
+
+/*
+  Index column of train_rows, whose rows have the route ids route_ids.
+  The index stays unusable when a value is not an integer, as the order
+  of the routing instance could not be reproduced then.
+*/
+int range_index::build(route_rows *train_rows,uint column,uint *route_ids,MEM_ROOT *root)
+{
+	MYSQL_ROW row;
+	ROUTE_VALUE *values;
+	uint rows=0,idx;
+	int error;
+	usable=false;
+	intervals_count=0;
+	if(!(values=(ROUTE_VALUE *)my_malloc((train_rows->count+1)*sizeof(ROUTE_VALUE),MYF(MY_WME))))
+		return 1;
+	for(idx=0;idx<train_rows->count;idx++)
+	{
+		char *end;
+		row=train_rows->row(idx);
+		if(!row[column])
+			continue;
+		end=row[column]+strlen(row[column]);
+		values[rows].value=my_strtoll10(row[column],&end,&error);
+		if(error>0||*end)
+		{
+			my_free(values);
+			return 0;
+		}
+		values[rows++].route=route_ids[idx];
+	}
+	my_qsort(values,rows,sizeof(ROUTE_VALUE),route_value_cmp);
+	if(!(intervals=(ROUTE_INTERVAL *)alloc_root(root,(rows+1)*sizeof(ROUTE_INTERVAL))))
+	{
+		my_free(values);
+		return 1;
+	}
+	for(idx=0;idx<rows;idx++)
+	{
+		ROUTE_INTERVAL *last=intervals_count?&intervals[intervals_count-1]:NULL;
+		if(last&&last->route==values[idx].route)
+		{
+			last->max=values[idx].value;
+			continue;
+		}
+		intervals[intervals_count].min=values[idx].value;
+		intervals[intervals_count].max=values[idx].value;
+		intervals[intervals_count].route=values[idx].route;
+		intervals_count++;
+	}
+	my_free(values);
+	usable=true;
+	return 0;
+}
+
+/* index of the first interval that ends at or after min */
+uint range_index::first_interval(longlong min)
+{
+	uint low=0,high=intervals_count;
+	while(low<high)
+	{
+		uint middle=(low+high)/2;
+		if(intervals[middle].max<min)
+			low=middle+1;
+		else
+			high=middle;
+	}
+	return low;
+}
+
+/* a distinct shard of train_map while it is loaded */
+typedef struct mydb_route_id{
+	char *key;
+	uint key_length;
+	uint id;
+	ROUTE route;
+}ROUTE_ID;
+
+static uchar* route_id_get_key(ROUTE_ID *route_id, size_t *length,
+                             my_bool not_used __attribute__((unused)))
+{
+	*length=route_id->key_length;
+	return (uchar*) route_id->key;
+}
+
+/*
+  Index trainid and packageid of all of train_map, as read by
+  route_snapshot: trainid, packageid, serverip, serverport, shard_schema,
+  shard_prefix. Each distinct shard becomes one route, so the intervals
+  only carry its number.
+*/
+int range_router::load(route_rows *rows)
+{
+	DBUG_ENTER("range_router::load");
+	MYSQL_ROW row;
+	HASH route_ids;
+	uint *ids=NULL,idx,length;
+	int error=1;
+	if(rows->fields<6)
+		DBUG_RETURN(1);
+	if(my_hash_init(&route_ids,&my_charset_bin,64,0,0,
+		(my_hash_get_key) route_id_get_key,0,HASH_UNIQUE))
+		DBUG_RETURN(1);
+	if(!(ids=(uint *)my_malloc((rows->count+1)*sizeof(uint),MYF(MY_WME))))
+		goto end;
+	for(idx=0;idx<rows->count;idx++)
+	{
+		row=rows->row(idx);
+		char key[MYDB_ROUTE_KEY_LENGTH];
+		ROUTE_ID *route_id;
+		int err;
+		length=my_snprintf(key,sizeof(key),"%s:%s/%s/%s",row[2]?row[2]:"",row[3]?row[3]:"",
+			row[4]?row[4]:"",row[5]?row[5]:"");
+		if(!(route_id=(ROUTE_ID *)my_hash_search(&route_ids,(uchar *)key,length)))
+		{
+			if(!(route_id=(ROUTE_ID *)alloc_root(&mem_root,sizeof(ROUTE_ID)))||
+				!(route_id->key=strmake_root(&mem_root,key,length)))
+				goto end;
+			route_id->key_length=length;
+			route_id->id=routes_count++;
+			route_id->route.server=strdup_root(&mem_root,row[2]?row[2]:"");
+			route_id->route.sport=row[3]?(uint) my_strtoll10(row[3],(char**) 0,&err):0;
+			route_id->route.schema=strdup_root(&mem_root,row[4]?row[4]:"");
+			route_id->route.prefix=strdup_root(&mem_root,row[5]?row[5]:"");
+			if(my_hash_insert(&route_ids,(uchar *)route_id))
+				goto end;
+		}
+		ids[idx]=route_id->id;
+	}
+	if(!(routes=(ROUTE *)alloc_root(&mem_root,(routes_count+1)*sizeof(ROUTE))))
+		goto end;
+	for(idx=0;idx<route_ids.records;idx++)
+	{
+		ROUTE_ID *route_id=(ROUTE_ID *)my_hash_element(&route_ids,idx);
+		routes[route_id->id]=route_id->route;
+	}
+	if(train.build(rows,0,ids,&mem_root)||package.build(rows,1,ids,&mem_root))
+		goto end;
+	error=0;
+end:
+	my_free(ids);
+	my_hash_free(&route_ids);
+	DBUG_RETURN(error);
+}
+
+/*
+  Add the shards holding field values from min to max to shards, and to
+  keys with the part of the range each interval covers. Returns -1 when
+  the range cannot be answered from the index, otherwise the number of
+  shards it covers.
+*/
+int range_router::lookup(const char *field,const char *min,const char *max,
+	List<CONNECT_PARAM> *shards,MEM_ROOT *root,shard_keys *keys)
+{
+	range_index *index;
+	longlong low,high;
+	char *end;
+	int error;
+	uchar *seen;
+	int found=0;
+	if(!strcmp(field,MYDB_TRAIN_MAP_ID))
+		index=&train;
+	else if(!strcmp(field,MYDB_PACKAGE_MAP_ID))
+		index=&package;
+	else
+		return -1;
+	if(!index->usable||!min||!max)
+		return -1;
+	end=(char *)min+strlen(min);
+	low=my_strtoll10(min,&end,&error);
+	if(error>0||*end)
+		return -1;
+	end=(char *)max+strlen(max);
+	high=my_strtoll10(max,&end,&error);
+	if(error>0||*end)
+		return -1;
+	if(!(seen=(uchar *)my_malloc(routes_count+1,MYF(MY_WME|MY_ZEROFILL))))
+		return -1;
+	for(uint idx=index->first_interval(low);
+		idx<index->intervals_count&&index->intervals[idx].min<=high;idx++)
+	{
+		ROUTE_INTERVAL *interval=&index->intervals[idx];
+		keys->add_range(add_shard_route(shards,root,&routes[interval->route]),
+			MY_MAX(interval->min,low),MY_MIN(interval->max,high));
+		if(seen[interval->route])
+			continue;
+		seen[interval->route]=1;
+		found++;
+	}
+	my_free(seen);
+	return found;
+}
@@ -0,0 +1,141 @@
+#define MYSQL_SERVER 1
+#include "sql_class.h"
+#include "ha_gatherdb.h"
+
+/*
+  Snapshot file layout, all integers little-endian:
+    magic[8] format:4 checksum[MYDB_ROUTE_CHECKSUM_LENGTH]
+    then ROUTE_SETS times  fields:4 rows:4 and rows*fields values
+    then crc32 of everything before it:4
+  A value is length:4 followed by length bytes and a NUL, or only the
+  length UINT_MAX32 for NULL. A set the routing instance did not return
+  is stored with 0 fields.
+*/
+#define SNAPSHOT_HEADER_LENGTH (8+4+MYDB_ROUTE_CHECKSUM_LENGTH)
+
+static bool append_uint4(String *buff,uint32 value)
+{
+	char tmp[4];
+	int4store(tmp,value);
+	return buff->append(tmp,4);
+}
+
+/*
+  Write sets to file. The file is written under a temporary name and
+  renamed over the old one, so a reader never maps a partial snapshot.
+*/
+int route_snapshot::save(const char *file,route_rows *sets)
+{
+	DBUG_ENTER("route_snapshot::save");
+	char tmp_name[FN_REFLEN];
+	String buff;
+	File fd;
+	int error=1;
+	buff.append(STRING_WITH_LEN(MYDB_ROUTE_SNAPSHOT_MAGIC));
+	append_uint4(&buff,MYDB_ROUTE_SNAPSHOT_FORMAT);
+	buff.append(checksum,sizeof(checksum));
+	for(uint set=0;set<ROUTE_SETS;set++)
+	{
+		route_rows *rows=&sets[set];
+		append_uint4(&buff,rows->fields);
+		append_uint4(&buff,rows->fields?rows->count:0);
+		for(ulong idx=0;rows->fields&&idx<(ulong) rows->fields*rows->count;idx++)
+		{
+			char *value=rows->values[idx];
+			if(!value)
+			{
+				append_uint4(&buff,UINT_MAX32);
+				continue;
+			}
+			uint32 length=(uint32) strlen(value);
+			append_uint4(&buff,length);
+			buff.append(value,length+1);
+		}
+	}
+	if(append_uint4(&buff,(uint32) my_checksum(0,(uchar *)buff.ptr(),buff.length())))
+		DBUG_RETURN(1);
+	my_snprintf(tmp_name,sizeof(tmp_name),"%s.tmp",file);
+	if((fd=my_create(tmp_name,0,O_WRONLY|O_TRUNC,MYF(0)))<0)
+		DBUG_RETURN(1);
+	if(!my_write(fd,(uchar *)buff.ptr(),buff.length(),MYF(MY_NABP))&&!my_sync(fd,MYF(0)))
+		error=0;
+	if(my_close(fd,MYF(0)))
+		error=1;
+	if(!error&&my_rename(tmp_name,file,MYF(0)))
+		error=1;
+	if(error)
+		(void) my_delete(tmp_name,MYF(0));
+	DBUG_RETURN(error);
+}
+
+/*
+  Map file and build the snapshot straight from the mapping; the rows
+  point into it until build() has copied what it keeps. Any file that is
+  short, of another format or fails its crc is ignored.
+*/
+int route_snapshot::load_file(const char *file)
+{
+	DBUG_ENTER("route_snapshot::load_file");
+	route_rows sets[ROUTE_SETS];
+	MY_STAT stat_info;
+	uchar *map,*pos,*end;
+	size_t size;
+	File fd;
+	int error=1;
+	if((fd=my_open(file,O_RDONLY,MYF(0)))<0)
+		DBUG_RETURN(1);
+	if(!my_fstat(fd,&stat_info,MYF(0)))
+		size=(size_t) stat_info.st_size;
+	else
+		size=0;
+	if(size<SNAPSHOT_HEADER_LENGTH+4||
+		(map=(uchar *)my_mmap(0,size,PROT_READ,MAP_PRIVATE,fd,0))==MAP_FAILED)
+	{
+		my_close(fd,MYF(0));
+		DBUG_RETURN(1);
+	}
+	my_close(fd,MYF(0));
+	end=map+size-4;
+	if(memcmp(map,MYDB_ROUTE_SNAPSHOT_MAGIC,8)||
+		uint4korr(map+8)!=MYDB_ROUTE_SNAPSHOT_FORMAT||
+		uint4korr(end)!=(uint32) my_checksum(0,map,size-4))
+		goto end;
+	memcpy(checksum,map+12,sizeof(checksum));
+	checksum[sizeof(checksum)-1]=0;
+	pos=map+SNAPSHOT_HEADER_LENGTH;
+	for(uint set=0;set<ROUTE_SETS;set++)
+	{
+		uint fields,count;
+		if(end-pos<8)
+			goto end;
+		fields=uint4korr(pos);
+		count=uint4korr(pos+4);
+		pos+=8;
+		if(!fields)
+			continue;
+		/* every value takes at least its length */
+		if((ulonglong) fields*count>(ulonglong)(end-pos)/4||sets[set].init(fields,count))
+			goto end;
+		for(ulong idx=0;idx<(ulong) fields*count;idx++)
+		{
+			uint32 length;
+			if(end-pos<4)
+				goto end;
+			length=uint4korr(pos);
+			pos+=4;
+			if(length==UINT_MAX32)
+				continue;
+			if((ulonglong)(end-pos)<(ulonglong) length+1||pos[length])
+				goto end;
+			sets[set].values[idx]=(char *)pos;
+			pos+=length+1;
+		}
+	}
+	if(pos==end)
+		error=build(sets);
+end:
+	for(uint set=0;set<ROUTE_SETS;set++)
+		sets[set].dispose();
+	my_munmap((char *)map,size);
+	DBUG_RETURN(error);
+}
@@ -0,0 +1,326 @@
+#define MYSQL_SERVER 1
+#include "sql_class.h"
+#include "ha_gatherdb.h"
+
+int route_rows::init(uint fields_count,uint rows_count)
+{
+	fields=fields_count;
+	count=rows_count;
+	if(!(values=(char **)my_malloc(((ulong) fields*count+1)*sizeof(char *),MYF(MY_WME|MY_ZEROFILL))))
+		return 1;
+	return 0;
+}
+
+/* run sql on the routing instance and take its rows; fields stays 0 on failure */
+int route_rows::fetch(connpool *pool,ulong wait_timeout,const char *sql,uint length)
+{
+	MYSQL_ROW row;
+	if(!(result=pool->store_query(&sharding_instance_param,sql,length,wait_timeout)))
+		return 1;
+	if(init(mysql_num_fields(result),(uint) mysql_num_rows(result)))
+	{
+		dispose();
+		return 1;
+	}
+	for(uint idx=0;(row=mysql_fetch_row(result));idx++)
+		memcpy(values+idx*fields,row,fields*sizeof(char *));
+	return 0;
+}
+
+void route_rows::dispose()
+{
+	my_free(values);
+	values=0;
+	if(result)
+		mysql_free_result(result);
+	result=0;
+	fields=count=0;
+}
+
+/*
+  Build the snapshot from the rows of the metadata queries. Without the
+  range index or the sharding functions routing still works through
+  train_map, so only a missing table set fails.
+*/
+int route_snapshot::build(route_rows *sets)
+{
+	DBUG_ENTER("route_snapshot::build");
+	if(tables.init(&sets[ROUTE_SET_TABLES]))
+		DBUG_RETURN(1);
+	ranges=new range_router();
+	if(ranges->load(&sets[ROUTE_SET_TRAIN]))
+	{
+		delete ranges;
+		ranges=0;
+	}
+	rules=new shard_rules();
+	if(rules->load(&sets[ROUTE_SET_RULES]))
+	{
+		delete rules;
+		rules=0;
+	}
+	DBUG_RETURN(0);
+}
+
+/*
+  Read the routing metadata from the routing instance into this snapshot
+  and, when file is set, save it there for the next start.
+*/
+int route_snapshot::load(connpool *pool,ulong wait_timeout,const char *sum,const char *file)
+{
+	DBUG_ENTER("route_snapshot::load");
+	char sql[MYDB_MAX_SQL_LENGTH];
+	route_rows sets[ROUTE_SETS];
+	uint length;
+	strmake(checksum,sum,sizeof(checksum)-1);
+	length=my_snprintf(sql,sizeof(sql),"select table_name from %s",MYDB_TABLE_MAP);
+	if(sets[ROUTE_SET_TABLES].fetch(pool,wait_timeout,sql,length))
+		DBUG_RETURN(1);
+	length=my_snprintf(sql,sizeof(sql),"select %s,%s,serverip,serverport,shard_schema,shard_prefix from %s",
+		MYDB_TRAIN_MAP_ID,MYDB_PACKAGE_MAP_ID,MYDB_TRAIN_MAP);
+	(void) sets[ROUTE_SET_TRAIN].fetch(pool,wait_timeout,sql,length);
+	length=my_snprintf(sql,sizeof(sql),"select table_name,func,field,node,bound,"
+		"serverip,serverport,shard_schema,shard_prefix from %s order by table_name,node",
+		MYDB_SHARD_RULE);
+	(void) sets[ROUTE_SET_RULES].fetch(pool,wait_timeout,sql,length);
+	if(build(sets))
+		DBUG_RETURN(1);
+	if(file&&*file)
+		(void) save(file,sets);
+	DBUG_RETURN(0);
+}
+
+int route_state::init(connpool *pool,route_cache *cache)
+{
+	DBUG_ENTER("route_state::init");
+	cpool=pool;
+	rcache=cache;
+	mysql_mutex_init(key_mutex_route_state, &mutex, MY_MUTEX_INIT_FAST);
+	mysql_cond_init(key_cond_route_state, &cond, NULL);
+	DBUG_RETURN(0);
+}
+
+/*
+  Pin the current snapshot until leave(slot). The reader is counted in
+  the slot of the epoch it saw, and only once the epoch is seen again
+  after that, so publish() cannot miss it. NULL while nothing has been
+  loaded yet.
+*/
+route_snapshot *route_state::enter(uint *slot)
+{
+	int32 seen;
+	for(;;)
+	{
+		seen=my_atomic_load32(&epoch);
+		my_atomic_add32(&readers[seen&1],1);
+		if(my_atomic_load32(&epoch)==seen)
+			break;
+		my_atomic_add32(&readers[seen&1],-1);
+	}
+	*slot=seen&1;
+	return (route_snapshot *)my_atomic_loadptr((void * volatile *)&current);
+}
+
+void route_state::leave(uint slot)
+{
+	my_atomic_add32(&readers[slot],-1);
+}
+
+/*
+  Make snapshot the current one and free the one it replaces. A reader
+  that can still see the old snapshot entered before the epoch moved on,
+  so once its slot drains nobody holds it. The previous publish() drained
+  the other slot already. Only one thread publishes at a time.
+*/
+void route_state::publish(route_snapshot *snapshot)
+{
+	DBUG_ENTER("route_state::publish");
+	route_snapshot *old=current;
+	int32 seen;
+	snapshot->version=old?old->version+1:1;
+	my_atomic_storeptr((void * volatile *)&current,snapshot);
+	seen=my_atomic_load32(&epoch);
+	my_atomic_store32(&epoch,seen+1);
+	while(my_atomic_load32(&readers[seen&1]))
+		my_sleep(100);
+	delete old;
+	reloads++;
+	/* cached routes may come from the train_map rows just replaced */
+	if(rcache)
+		rcache->flush();
+	DBUG_VOID_RETURN;
+}
+
+/*
+  CHECKSUM TABLE of the metadata tables, as one string. A table that does
+  not exist has a NULL checksum and shows as "-".
+*/
+int route_state::checksum(char *sum)
+{
+	char sql[MYDB_MAX_SQL_LENGTH];
+	MYSQL_RES *result;
+	MYSQL_ROW row;
+	char *pos=sum,*end=sum+MYDB_ROUTE_CHECKSUM_LENGTH-1;
+	uint length=my_snprintf(sql,sizeof(sql),"checksum table %s,%s,%s",
+		MYDB_TABLE_MAP,MYDB_TRAIN_MAP,MYDB_SHARD_RULE);
+	int error=0;
+	if(!(result=cpool->store_query(&sharding_instance_param,sql,length,wait_timeout)))
+		return 1;
+	*pos=0;
+	while((row=mysql_fetch_row(result)))
+	{
+		if(mysql_num_fields(result)<2)
+		{
+			error=1;
+			break;
+		}
+		if(pos>sum)
+			pos=strnmov(pos,"/",end-pos);
+		pos=strnmov(pos,row[1]?row[1]:"-",end-pos);
+	}
+	*pos=0;
+	mysql_free_result(result);
+	return error;
+}
+
+/*
+  Load a new snapshot when the routing metadata differs from the one the
+  current snapshot was read from. A failed load keeps the current one,
+  which may be the last one saved to snapshot_file.
+*/
+int route_state::refresh()
+{
+	DBUG_ENTER("route_state::refresh");
+	char sum[MYDB_ROUTE_CHECKSUM_LENGTH];
+	route_snapshot *snapshot;
+	if(checksum(sum))
+		DBUG_RETURN(1);
+	if(current&&!strcmp(current->checksum,sum))
+	{
+		confirmed=true;
+		DBUG_RETURN(0);
+	}
+	snapshot=new route_snapshot();
+	if(snapshot->load(cpool,wait_timeout,sum,snapshot_file))
+	{
+		delete snapshot;
+		DBUG_RETURN(1);
+	}
+	publish(snapshot);
+	confirmed=true;
+	DBUG_RETURN(0);
+}
+
+/*
+  Start from the snapshot saved by an earlier run, without waiting for
+  the routing instance. The refresh thread checks it right away.
+*/
+int route_state::load_file()
+{
+	DBUG_ENTER("route_state::load_file");
+	route_snapshot *snapshot;
+	if(!snapshot_file||!*snapshot_file)
+		DBUG_RETURN(1);
+	snapshot=new route_snapshot();
+	if(snapshot->load_file(snapshot_file))
+	{
+		delete snapshot;
+		DBUG_RETURN(1);
+	}
+	publish(snapshot);
+	confirmed=false;
+	DBUG_RETURN(0);
+}
+
+void route_state::set_refresh_interval(uint interval)
+{
+	mysql_mutex_lock(&mutex);
+	refresh_interval=interval;
+	mysql_cond_signal(&cond);
+	mysql_mutex_unlock(&mutex);
+}
+
+static void *route_refresh(void *arg)
+{
+	my_thread_init();
+	((route_state *)arg)->refresh_loop();
+	my_thread_end();
+	pthread_exit(0);
+	return NULL;
+}
+
+/*
+  Poll every refresh_interval seconds, or every MYDB_ROUTE_RETRY_INTERVAL
+  until the routing instance has been reached once. A snapshot from the
+  file is checked at once. An interval of 0 stops polling after that.
+*/
+void route_state::refresh_loop()
+{
+	struct timespec abstime;
+	uint interval;
+	bool first=!confirmed&&current;
+	mysql_mutex_lock(&mutex);
+	while(!stopping)
+	{
+		interval=confirmed?refresh_interval:MYDB_ROUTE_RETRY_INTERVAL;
+		if(first)
+			first=false;
+		else if(interval)
+		{
+			set_timespec(abstime,interval);
+			if(!mysql_cond_timedwait(&cond,&mutex,&abstime))
+				continue;
+		}
+		else
+		{
+			mysql_cond_wait(&cond,&mutex);
+			continue;
+		}
+		if(stopping)
+			break;
+		mysql_mutex_unlock(&mutex);
+		refresh();
+		mysql_mutex_lock(&mutex);
+	}
+	mysql_mutex_unlock(&mutex);
+}
+
+int route_state::start_refresh()
+{
+	DBUG_ENTER("route_state::start_refresh");
+	pthread_attr_t attr;
+	stopping=false;
+	pthread_attr_init(&attr);
+	if(mysql_thread_create(key_thread_route_refresh,&refresh_thread,
+		&attr,route_refresh,(void *)this))
+	{
+		pthread_attr_destroy(&attr);
+		DBUG_RETURN(1);
+	}
+	pthread_attr_destroy(&attr);
+	refresh_running=true;
+	DBUG_RETURN(0);
+}
+
+void route_state::stop_refresh()
+{
+	DBUG_ENTER("route_state::stop_refresh");
+	if(!refresh_running)
+		DBUG_VOID_RETURN;
+	mysql_mutex_lock(&mutex);
+	stopping=true;
+	mysql_cond_signal(&cond);
+	mysql_mutex_unlock(&mutex);
+	pthread_join(refresh_thread,NULL);
+	refresh_running=false;
+	DBUG_VOID_RETURN;
+}
+
+void route_state::dispose()
+{
+	stop_refresh();
+	delete current;
+	current=0;
+	mysql_cond_destroy(&cond);
+	mysql_mutex_destroy(&mutex);
+}
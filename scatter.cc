@@ -0,0 +1,573 @@
+#define MYSQL_SERVER 1
+#include "sql_class.h"
+#include "ha_gatherdb.h"
+#include "mysql.h"
+#include "errmsg.h"
+
+scatter_job::scatter_job(connpool *pool,ulong timeout)
+{
+	cpool=pool;
+	spool=0;
+	wait_timeout=timeout;
+	use_result=false;
+	shards=0;
+	tasks=0;
+	done=0;
+	batches=0;
+	ready_first=ready_last=0;
+	count=done_count=pending=live=0;
+	error=0;
+	failed=-1;
+	cancelled=false;
+	mysql_mutex_init(key_mutex_scatter_job, &mutex, MY_MUTEX_INIT_FAST);
+	mysql_cond_init(key_cond_scatter_job, &cond, NULL);
+}
+
+scatter_job::~scatter_job()
+{
+	delete [] batches;
+	my_free(shards);
+	mysql_cond_destroy(&cond);
+	mysql_mutex_destroy(&mutex);
+}
+
+int scatter_job::init(uint shards_count,bool unbuffered)
+{
+	if(!my_multi_malloc(MYF(MY_WME|MY_ZEROFILL),
+		&shards,shards_count*sizeof(SHARD_REQUEST),
+		&tasks,shards_count*sizeof(SCATTER_TASK),
+		&done,shards_count*sizeof(uint),
+		NullS))
+		return 1;
+	count=pending=live=shards_count;
+	use_result=unbuffered;
+	for(uint idx=0;idx<count;idx++)
+	{
+		tasks[idx].job=this;
+		tasks[idx].shard=idx;
+	}
+	return 0;
+}
+
+/*
+  Give every shard MYDB_PIPELINE_DEPTH batches. bytes is the budget of
+  the whole scan and is split evenly between them.
+*/
+int scatter_job::init_batches(uint fields,uint rows,ulong bytes)
+{
+	uint total=count*MYDB_PIPELINE_DEPTH;
+	if(!(batches=new row_batch[total]))
+		return 1;
+	for(uint idx=0;idx<total;idx++)
+	{
+		row_batch *batch=&batches[idx];
+		if(batch->init(fields,rows,bytes/total))
+			return 1;
+		batch->shard=idx/MYDB_PIPELINE_DEPTH;
+		batch->link=shards[batch->shard].spare;
+		shards[batch->shard].spare=batch;
+	}
+	return 0;
+}
+
+/* keep the error of the shard's connection for the reader to report */
+static int shard_failed(SHARD_REQUEST *shard)
+{
+	strmake(shard->message,mysql_error(shard->connection->mysql),sizeof(shard->message)-1);
+	check_alive(shard->connection);
+	return HA_ERR_INTERNAL_ERROR;
+}
+
+/*
+  Check out a connection and send the shard statement on it. A query
+  that fails, or whose result cannot be read, fails the shard.
+*/
+int scatter_job::send(SHARD_REQUEST *shard)
+{
+	MYSQL *mysql;
+	if(!(shard->connection=cpool->fetchone(shard->param,wait_timeout)))
+	{
+		my_snprintf(shard->message,sizeof(shard->message),"no connection to %s:%u",
+			shard->param->instance->server,shard->param->instance->sport);
+		return HA_ERR_NO_CONNECTION;
+	}
+	mysql=shard->connection->mysql;
+	if(mysql_real_query(mysql,shard->sql,strlen(shard->sql)))
+		return shard_failed(shard);
+	shard->result=use_result?mysql_use_result(mysql):mysql_store_result(mysql);
+	if(!shard->result&&(mysql_errno(mysql)||mysql_field_count(mysql)))
+		return shard_failed(shard);
+	return 0;
+}
+
+void scatter_job::run(SCATTER_TASK *task)
+{
+	if(use_result)
+	{
+		step(task);
+		return;
+	}
+	SHARD_REQUEST *shard=&shards[task->shard];
+	shard->error=send(shard);
+	mysql_mutex_lock(&mutex);
+	done[done_count++]=task->shard;
+	if(!--pending)
+		mysql_cond_signal(&cond);
+	mysql_mutex_unlock(&mutex);
+}
+
+/*
+  One pipeline step of a streamed shard. The first step sends the query;
+  every step moves one batch of rows to the ready queue. The task queues
+  itself again while the shard has a spare batch and parks otherwise,
+  until release() hands one back.
+*/
+void scatter_job::step(SCATTER_TASK *task)
+{
+	SHARD_REQUEST *shard=&shards[task->shard];
+	row_batch *batch;
+	int rows=0,res=0;
+	mysql_mutex_lock(&mutex);
+	if((batch=cancelled?NULL:shard->spare))
+		shard->spare=batch->link;
+	mysql_mutex_unlock(&mutex);
+	if(batch)
+	{
+		if(!shard->connection)
+			res=send(shard);
+		if(shard->result&&(rows=batch->fill(shard->result))<0)
+			res=HA_ERR_OUT_OF_MEM;
+		else if(shard->result&&!rows&&mysql_errno(shard->connection->mysql))
+			res=shard_failed(shard);
+	}
+	mysql_mutex_lock(&mutex);
+	if(batch)
+	{
+		if(rows>0)
+		{
+			batch->link=NULL;
+			if(ready_last) ready_last->link=batch;
+			else ready_first=batch;
+			ready_last=batch;
+		}
+		else
+		{
+			batch->link=shard->spare;
+			shard->spare=batch;
+			shard->eof=true;
+			live--;
+		}
+		if(res&&!error)
+		{
+			error=res;
+			failed=(int) task->shard;
+		}
+	}
+	pending--;
+	if(!cancelled&&!shard->eof)
+	{
+		if(shard->spare)
+		{
+			pending++;
+			spool->submit(task);
+		}
+		else
+			shard->parked=true;
+	}
+	mysql_cond_signal(&cond);
+	mysql_mutex_unlock(&mutex);
+}
+
+/*
+  Next batch of rows from whichever shard has one ready. While nothing is
+  ready the reader runs queued steps of its own job, so the scan moves on
+  even when every worker is busy. NULL at the end of all shards or on
+  error.
+*/
+row_batch *scatter_job::take()
+{
+	row_batch *batch=NULL;
+	mysql_mutex_lock(&mutex);
+	while(!error&&!(batch=ready_first)&&live)
+	{
+		uint idx;
+		for(idx=0;idx<count;idx++)
+		{
+			if(!shards[idx].eof&&!shards[idx].parked&&spool->claim(&tasks[idx]))
+				break;
+		}
+		if(idx<count)
+		{
+			mysql_mutex_unlock(&mutex);
+			step(&tasks[idx]);
+			mysql_mutex_lock(&mutex);
+		}
+		else
+			mysql_cond_wait(&cond,&mutex);
+	}
+	if(error)
+		batch=NULL;
+	else if(batch&&!(ready_first=batch->link))
+		ready_last=NULL;
+	mysql_mutex_unlock(&mutex);
+	return batch;
+}
+
+/*
+  take() for a merge of sorted shards: the next batch of one shard, in
+  the order the shard filled them. NULL at the end of the shard or on
+  error.
+*/
+row_batch *scatter_job::take_shard(uint shard)
+{
+	row_batch *batch,*prev;
+	mysql_mutex_lock(&mutex);
+	for(;;)
+	{
+		for(prev=NULL,batch=ready_first;batch&&batch->shard!=shard;batch=batch->link)
+			prev=batch;
+		if(error||batch||shards[shard].eof)
+			break;
+		uint idx;
+		for(idx=0;idx<count;idx++)
+		{
+			if(!shards[idx].eof&&!shards[idx].parked&&spool->claim(&tasks[idx]))
+				break;
+		}
+		if(idx<count)
+		{
+			mysql_mutex_unlock(&mutex);
+			step(&tasks[idx]);
+			mysql_mutex_lock(&mutex);
+		}
+		else
+			mysql_cond_wait(&cond,&mutex);
+	}
+	if(error)
+		batch=NULL;
+	else if(batch)
+	{
+		if(prev) prev->link=batch->link;
+		else ready_first=batch->link;
+		if(ready_last==batch)
+			ready_last=prev;
+	}
+	mysql_mutex_unlock(&mutex);
+	return batch;
+}
+
+/* give a read batch back to its shard and wake the shard up if parked */
+void scatter_job::release(row_batch *batch)
+{
+	SHARD_REQUEST *shard=&shards[batch->shard];
+	batch->reset();
+	mysql_mutex_lock(&mutex);
+	batch->link=shard->spare;
+	shard->spare=batch;
+	if(shard->parked&&!cancelled)
+	{
+		shard->parked=false;
+		pending++;
+		spool->submit(&tasks[batch->shard]);
+	}
+	mysql_mutex_unlock(&mutex);
+}
+
+/* stop a streamed job: drop its queued steps and wait for running ones */
+void scatter_job::cancel()
+{
+	mysql_mutex_lock(&mutex);
+	cancelled=true;
+	for(uint idx=0;idx<count;idx++)
+	{
+		if(spool->claim(&tasks[idx]))
+			pending--;
+	}
+	while(pending)
+		mysql_cond_wait(&cond,&mutex);
+	mysql_mutex_unlock(&mutex);
+}
+
+/*
+  After cancel(): interrupt the shards whose result has not been read to
+  its end, so that freeing it does not read the rest of it first.
+*/
+void scatter_job::kill_running()
+{
+	for(uint idx=0;idx<count;idx++)
+	{
+		SHARD_REQUEST *shard=&shards[idx];
+		if(shard->result&&!shard->eof)
+			(void) cpool->kill_query(shard->connection,shard->param);
+	}
+}
+
+#define NULL_OFFSET (~(ulong)0)
+
+/*
+  fields_count is only the width expected, fill() sizes the batch again
+  for a result of another width.
+*/
+int row_batch::init(uint fields_count,uint rows_count,ulong bytes)
+{
+	dispose();
+	max_rows=rows_count?rows_count:1;
+	max_bytes=bytes;
+	return set_fields(fields_count);
+}
+
+/* size the row arrays for rows of fields_count columns, dropping the rows */
+int row_batch::set_fields(uint fields_count)
+{
+	my_free(offsets);
+	offsets=lengths=0;
+	values=0;
+	fields=0;
+	rows=read=0;
+	used=0;
+	if(!my_multi_malloc(MYF(MY_WME),
+		&offsets,max_rows*MY_MAX(fields_count,1)*sizeof(ulong),
+		&lengths,max_rows*MY_MAX(fields_count,1)*sizeof(ulong),
+		&values,MY_MAX(fields_count,1)*sizeof(char *),
+		NullS))
+		return 1;
+	fields=fields_count;
+	return 0;
+}
+
+void row_batch::dispose()
+{
+	my_free(offsets);
+	my_free(buffer);
+	offsets=lengths=0;
+	values=0;
+	buffer=0;
+	buffer_size=0;
+	reset();
+}
+
+/* copy one row into the batch; -1 when out of memory */
+int row_batch::add_row(MYSQL_ROW row,ulong *row_lengths)
+{
+	ulong need=0;
+	uint idx;
+	for(idx=0;idx<fields;idx++)
+	{
+		if(row[idx])
+			need+=row_lengths[idx]+1;
+	}
+	if(used+need>buffer_size)
+	{
+		ulong size=MY_MAX(used+need,MY_MIN(buffer_size*2,max_bytes));
+		uchar *grown;
+		if(!(grown=(uchar *)my_realloc(buffer,size,MYF(MY_WME|MY_ALLOW_ZERO_PTR))))
+			return -1;
+		buffer=grown;
+		buffer_size=size;
+	}
+	ulong *row_offsets=offsets+rows*fields;
+	memcpy(lengths+rows*fields,row_lengths,fields*sizeof(ulong));
+	for(idx=0;idx<fields;idx++)
+	{
+		if(!row[idx])
+		{
+			row_offsets[idx]=NULL_OFFSET;
+			continue;
+		}
+		row_offsets[idx]=used;
+		memcpy(buffer+used,row[idx],row_lengths[idx]);
+		buffer[used+row_lengths[idx]]=0;
+		used+=row_lengths[idx]+1;
+	}
+	rows++;
+	return 0;
+}
+
+/*
+  Replace the batch with the next rows of an unbuffered result. A fill
+  stops at max_rows or at the first row that takes it past max_bytes, so
+  a batch overshoots its budget by one row at most. Returns the number of
+  rows read, 0 at the end of the stream or when the connection failed
+  (check mysql_errno), and -1 when out of memory. The rows are as wide
+  as the result, whatever width the batch was made for.
+*/
+int row_batch::fill(MYSQL_RES *result)
+{
+	MYSQL_ROW row;
+	uint width=mysql_num_fields(result);
+	if(width!=fields&&set_fields(width))
+		return -1;
+	rows=read=0;
+	used=0;
+	while(rows<max_rows&&used<max_bytes&&(row=mysql_fetch_row(result)))
+	{
+		if(add_row(row,mysql_fetch_lengths(result)))
+			return -1;
+	}
+	return rows;
+}
+
+bool row_batch::next(MYSQL_ROW *row,ulong **row_lengths)
+{
+	if(read>=rows)
+		return false;
+	ulong *row_offsets=offsets+read*fields;
+	for(uint idx=0;idx<fields;idx++)
+		values[idx]=row_offsets[idx]==NULL_OFFSET?0:(char *)buffer+row_offsets[idx];
+	*row=values;
+	*row_lengths=lengths+read*fields;
+	read++;
+	return true;
+}
+
+static void *scatter_worker(void *arg)
+{
+	my_thread_init();
+	((scatter_pool *)arg)->worker();
+	my_thread_end();
+	pthread_exit(0);
+	return NULL;
+}
+
+int scatter_pool::start(uint threads_count)
+{
+	DBUG_ENTER("scatter_pool::start");
+	pthread_attr_t attr;
+	mysql_mutex_init(key_mutex_scatter_pool, &mutex, MY_MUTEX_INIT_FAST);
+	mysql_cond_init(key_cond_scatter_pool, &cond, NULL);
+	if(!threads_count)
+		DBUG_RETURN(0);
+	if(!(threads=(pthread_t *)my_malloc(threads_count*sizeof(pthread_t),MYF(MY_WME))))
+		DBUG_RETURN(1);
+	pthread_attr_init(&attr);
+	for(;thread_count<threads_count;thread_count++)
+	{
+		if(mysql_thread_create(key_thread_scatter_worker,&threads[thread_count],
+			&attr,scatter_worker,(void *)this))
+			break;
+	}
+	pthread_attr_destroy(&attr);
+	DBUG_RETURN(0);
+}
+
+void scatter_pool::stop()
+{
+	DBUG_ENTER("scatter_pool::stop");
+	mysql_mutex_lock(&mutex);
+	stopping=true;
+	mysql_cond_broadcast(&cond);
+	mysql_mutex_unlock(&mutex);
+	for(uint idx=0;idx<thread_count;idx++)
+		pthread_join(threads[idx],NULL);
+	my_free(threads);
+	threads=0;
+	thread_count=0;
+	mysql_cond_destroy(&cond);
+	mysql_mutex_destroy(&mutex);
+	DBUG_VOID_RETURN;
+}
+
+/* mutex held */
+void scatter_pool::unlink(SCATTER_TASK *task)
+{
+	if(task->prev) task->prev->next=task->next;
+	else first=task->next;
+	if(task->next) task->next->prev=task->prev;
+	else last=task->prev;
+	task->queued=false;
+}
+
+/* mutex held */
+void scatter_pool::append(SCATTER_TASK *task)
+{
+	task->next=NULL;
+	task->prev=last;
+	task->queued=true;
+	if(last) last->next=task;
+	else first=task;
+	last=task;
+}
+
+void scatter_pool::submit(SCATTER_TASK *task)
+{
+	mysql_mutex_lock(&mutex);
+	append(task);
+	mysql_cond_signal(&cond);
+	mysql_mutex_unlock(&mutex);
+}
+
+/* take a still queued task back from the workers */
+bool scatter_pool::claim(SCATTER_TASK *task)
+{
+	bool claimed;
+	mysql_mutex_lock(&mutex);
+	if((claimed=task->queued))
+		unlink(task);
+	mysql_mutex_unlock(&mutex);
+	return claimed;
+}
+
+void scatter_pool::worker()
+{
+	SCATTER_TASK *task;
+	mysql_mutex_lock(&mutex);
+	for(;;)
+	{
+		while(!first&&!stopping)
+			mysql_cond_wait(&cond,&mutex);
+		if(!(task=first))
+			break;
+		unlink(task);
+		mysql_mutex_unlock(&mutex);
+		task->job->run(task);
+		mysql_mutex_lock(&mutex);
+	}
+	mysql_mutex_unlock(&mutex);
+}
+
+/*
+  Run every shard of job concurrently and return once all of them have
+  completed. Shard latency therefore adds up to the slowest shard rather
+  than the sum.
+*/
+void scatter_pool::execute(scatter_job *job)
+{
+	DBUG_ENTER("scatter_pool::execute");
+	uint idx;
+	if(thread_count&&job->count>1)
+	{
+		mysql_mutex_lock(&mutex);
+		for(idx=1;idx<job->count;idx++)
+			append(&job->tasks[idx]);
+		mysql_cond_broadcast(&cond);
+		mysql_mutex_unlock(&mutex);
+		job->run(&job->tasks[0]);
+	}
+	for(idx=0;idx<job->count;idx++)
+	{
+		if(!thread_count||job->count==1||claim(&job->tasks[idx]))
+			job->run(&job->tasks[idx]);
+	}
+	mysql_mutex_lock(&job->mutex);
+	while(job->pending)
+		mysql_cond_wait(&job->cond,&job->mutex);
+	mysql_mutex_unlock(&job->mutex);
+	DBUG_VOID_RETURN;
+}
+
+/*
+  Start the shards of a streamed job and return at once; the reader pulls
+  batches with scatter_job::take() as the shards produce them and must
+  call scatter_job::cancel() before freeing the job.
+*/
+void scatter_pool::stream(scatter_job *job)
+{
+	DBUG_ENTER("scatter_pool::stream");
+	job->spool=this;
+	mysql_mutex_lock(&mutex);
+	for(uint idx=0;idx<job->count;idx++)
+		append(&job->tasks[idx]);
+	mysql_cond_broadcast(&cond);
+	mysql_mutex_unlock(&mutex);
+	DBUG_VOID_RETURN;
+}
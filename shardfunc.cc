@@ -0,0 +1,288 @@
+#define MYSQL_SERVER 1
+#include "sql_class.h"
+#include "ha_gatherdb.h"
+
+static uchar* rule_get_key(shard_rule *rule, size_t *length,
+                             my_bool not_used __attribute__((unused)))
+{
+	*length=rule->table_name_length;
+	return (uchar*) rule->table_name;
+}
+
+static int ring_point_cmp(const void *a,const void *b)
+{
+	const RING_POINT *x=(const RING_POINT *)a,*y=(const RING_POINT *)b;
+	if(x->hash!=y->hash)
+		return x->hash<y->hash?-1:1;
+	return x->node<y->node?-1:(x->node>y->node?1:0);
+}
+
+/* value as an integer, false when it is not one */
+static bool value_to_int(const char *value,longlong *result)
+{
+	char *end;
+	int error;
+	if(!value||!*value)
+		return false;
+	end=(char *)value+strlen(value);
+	*result=my_strtoll10(value,&end,&error);
+	return error<=0&&!*end;
+}
+
+int shard_rule::build_ring(MEM_ROOT *root)
+{
+	char key[MYDB_ROUTE_KEY_LENGTH];
+	uint length;
+	ring_count=nodes_count*MYDB_RING_POINTS;
+	if(!(ring=(RING_POINT *)alloc_root(root,(ring_count+1)*sizeof(RING_POINT))))
+		return 1;
+	for(uint node=0;node<nodes_count;node++)
+	{
+		for(uint point=0;point<MYDB_RING_POINTS;point++)
+		{
+			length=my_snprintf(key,sizeof(key),"%s:%u/%s/%s#%u",nodes[node].server,
+				nodes[node].sport,nodes[node].schema,nodes[node].prefix,point);
+			ring[node*MYDB_RING_POINTS+point].hash=my_checksum(0,(uchar *)key,length);
+			ring[node*MYDB_RING_POINTS+point].node=node;
+		}
+	}
+	my_qsort(ring,ring_count,sizeof(RING_POINT),ring_point_cmp);
+	return 0;
+}
+
+/* index of the first range node that can hold value, nodes_count if none */
+uint shard_rule::first_bound(longlong value)
+{
+	uint low=0,high=nodes_count;
+	while(low<high)
+	{
+		uint middle=(low+high)/2;
+		if(!unbounded[middle]&&bounds[middle]<value)
+			low=middle+1;
+		else
+			high=middle;
+	}
+	return low;
+}
+
+/*
+  The node holding value: -1 when the function cannot be evaluated for
+  it, nodes_count when no node holds it.
+*/
+int shard_rule::node_of(const char *value)
+{
+	char buff[22];
+	longlong number;
+	uint32 hash;
+	uint low,high;
+	bool is_int=value_to_int(value,&number);
+	switch(func)
+	{
+	case SHARD_FUNC_MODULO:
+		if(!is_int)
+			return -1;
+		number%=(longlong) nodes_count;
+		return (int)(number<0?number+nodes_count:number);
+	case SHARD_FUNC_RANGE:
+		if(!is_int)
+			return -1;
+		return (int) first_bound(number);
+	case SHARD_FUNC_HASH:
+		/* integers hash in canonical form, so 007 and 7 agree */
+		if(is_int)
+		{
+			longlong10_to_str(number,buff,-10);
+			value=buff;
+		}
+		hash=my_checksum(0,(uchar *)value,strlen(value));
+		low=0;
+		high=ring_count;
+		while(low<high)
+		{
+			uint middle=(low+high)/2;
+			if(ring[middle].hash<hash)
+				low=middle+1;
+			else
+				high=middle;
+		}
+		return (int) ring[low<ring_count?low:0].node;
+	}
+	return -1;
+}
+
+/* every node, and no value can tell their statements apart */
+void shard_rule::all_nodes(List<CONNECT_PARAM> *shards,MEM_ROOT *root,shard_keys *keys)
+{
+	for(uint node=0;node<nodes_count;node++)
+		add_shard_route(shards,root,&nodes[node]);
+	keys->disable();
+}
+
+void shard_rule::route_values(List<mydb_value_list> *values,List<CONNECT_PARAM> *shards,
+	MEM_ROOT *root,shard_keys *keys)
+{
+	List_iterator<mydb_value_list> li(*values);
+	mydb_value_list *value;
+	int node;
+	if(values->is_empty())
+	{
+		all_nodes(shards,root,keys);
+		return;
+	}
+	while((value=li++))
+	{
+		if((node=node_of(value->value))<0)
+		{
+			all_nodes(shards,root,keys);
+			return;
+		}
+		if((uint) node<nodes_count)
+			keys->add(add_shard_route(shards,root,&nodes[node]),value->value);
+		else
+			keys->add_none(value->value);
+	}
+}
+
+/*
+  Only a range function maps a range to a run of nodes. A modulo range
+  narrower than the node count is expanded value by value; anything else
+  scans every node.
+*/
+void shard_rule::route_range(const char *min,const char *max,List<CONNECT_PARAM> *shards,
+	MEM_ROOT *root,shard_keys *keys)
+{
+	longlong low,high;
+	if(!value_to_int(min,&low)||!value_to_int(max,&high))
+	{
+		all_nodes(shards,root,keys);
+		return;
+	}
+	if(low>high)
+		return;
+	if(func==SHARD_FUNC_RANGE)
+	{
+		uint last=first_bound(high);
+		if(last>=nodes_count)
+			last=nodes_count-1;
+		for(uint node=first_bound(low);node<=last&&node<nodes_count;node++)
+		{
+			/* node holds the values above the previous bound up to its own */
+			longlong node_min=node?bounds[node-1]+1:low;
+			longlong node_max=unbounded[node]?high:bounds[node];
+			keys->add_range(add_shard_route(shards,root,&nodes[node]),
+				MY_MAX(node_min,low),MY_MIN(node_max,high));
+		}
+		return;
+	}
+	if(func==SHARD_FUNC_MODULO&&(ulonglong)(high-low)<nodes_count)
+	{
+		for(longlong value=low;;value++)
+		{
+			longlong node=value%(longlong) nodes_count;
+			add_shard_route(shards,root,&nodes[node<0?node+nodes_count:node]);
+			if(value==high)
+				break;
+		}
+		keys->disable();
+		return;
+	}
+	all_nodes(shards,root,keys);
+}
+
+/*
+  Build the rule of one table from its shard_rule rows, in node order.
+  NULL when the rows do not describe a usable function; the table is
+  then routed through train_map.
+*/
+shard_rule *shard_rules::add_rule(MYSQL_ROW *rows,uint count)
+{
+	shard_rule *rule;
+	const char *func=rows[0][1]?rows[0][1]:"";
+	int err;
+	if(!rows[0][2]||
+		!(rule=(shard_rule *)alloc_root(&mem_root,sizeof(shard_rule))))
+		return NULL;
+	if(!my_strcasecmp(system_charset_info,func,"modulo"))
+		rule->func=SHARD_FUNC_MODULO;
+	else if(!my_strcasecmp(system_charset_info,func,"hash"))
+		rule->func=SHARD_FUNC_HASH;
+	else if(!my_strcasecmp(system_charset_info,func,"range"))
+		rule->func=SHARD_FUNC_RANGE;
+	else
+		return NULL;
+	rule->table_name_length=strlen(rows[0][0]);
+	rule->nodes_count=count;
+	rule->ring=0;
+	rule->ring_count=0;
+	if(!(rule->table_name=strmake_root(&mem_root,rows[0][0],rule->table_name_length))||
+		!(rule->field=strdup_root(&mem_root,rows[0][2]))||
+		!(rule->nodes=(ROUTE *)alloc_root(&mem_root,count*sizeof(ROUTE)))||
+		!(rule->bounds=(longlong *)alloc_root(&mem_root,count*sizeof(longlong)))||
+		!(rule->unbounded=(bool *)alloc_root(&mem_root,count*sizeof(bool))))
+		return NULL;
+	for(uint idx=0;idx<count;idx++)
+	{
+		MYSQL_ROW row=rows[idx];
+		ROUTE *node=&rule->nodes[idx];
+		node->server=strdup_root(&mem_root,row[5]?row[5]:"");
+		node->sport=row[6]?(uint) my_strtoll10(row[6],(char**) 0,&err):0;
+		node->schema=strdup_root(&mem_root,row[7]?row[7]:"");
+		node->prefix=strdup_root(&mem_root,row[8]?row[8]:"");
+		if(!node->server||!node->schema||!node->prefix)
+			return NULL;
+		rule->bounds[idx]=0;
+		rule->unbounded[idx]=!row[4];
+		if(rule->func!=SHARD_FUNC_RANGE)
+			continue;
+		/* ascending bounds, and only the last node may be unbounded */
+		if(idx&&rule->unbounded[idx-1])
+			return NULL;
+		if(row[4]&&(!value_to_int(row[4],&rule->bounds[idx])||
+			(idx&&rule->bounds[idx]<=rule->bounds[idx-1])))
+			return NULL;
+	}
+	if(rule->func==SHARD_FUNC_HASH&&rule->build_ring(&mem_root))
+		return NULL;
+	return rule;
+}
+
+/*
+  Build the rules from shard_rule as read by route_snapshot, one row per
+  node of a table ordered by table and node: table_name, func, field,
+  node, bound, serverip, serverport, shard_schema, shard_prefix.
+*/
+int shard_rules::load(route_rows *rule_rows)
+{
+	DBUG_ENTER("shard_rules::load");
+	MYSQL_ROW *rows,row;
+	uint count=0,first,idx;
+	shard_rule *rule;
+	if(rule_rows->fields<9||
+		!(rows=(MYSQL_ROW *)my_malloc((rule_rows->count+1)*sizeof(MYSQL_ROW),MYF(MY_WME))))
+		DBUG_RETURN(1);
+	for(idx=0;idx<rule_rows->count;idx++)
+	{
+		if((row=rule_rows->row(idx))[0])
+			rows[count++]=row;
+	}
+	if(my_hash_init(&rules,&my_charset_bin,count+1,0,0,
+		(my_hash_get_key) rule_get_key,0,HASH_UNIQUE))
+	{
+		my_free(rows);
+		DBUG_RETURN(1);
+	}
+	loaded=true;
+	for(first=0;first<count;first=idx)
+	{
+		for(idx=first+1;idx<count&&!strcmp(rows[idx][0],rows[first][0]);idx++);
+		if((rule=add_rule(rows+first,idx-first)))
+			(void) my_hash_insert(&rules,(uchar *)rule);
+	}
+	my_free(rows);
+	DBUG_RETURN(0);
+}
+
+shard_rule *shard_rules::find(const char *table_name)
+{
+	return loaded?(shard_rule *)my_hash_search(&rules,(uchar *)table_name,strlen(table_name)):NULL;
+}
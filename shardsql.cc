@@ -0,0 +1,1097 @@
+#define MYSQL_SERVER 1
+#include "sql_class.h"
+#include "ha_gatherdb.h"
+
+static const char *skip_space(const char *pos)
+{
+	for(;;)
+	{
+		while(my_isspace(system_charset_info,*pos))
+			pos++;
+		if(pos[0]=='/'&&pos[1]=='*')
+		{
+			const char *end=strstr(pos+2,"*/");
+			pos=end?end+2:pos+strlen(pos);
+		}
+		else if(*pos=='#'||(pos[0]=='-'&&pos[1]=='-'&&my_isspace(system_charset_info,pos[2])))
+		{
+			while(*pos&&*pos!='\n')
+				pos++;
+		}
+		else
+			return pos;
+	}
+}
+
+static bool is_ident_char(char c)
+{
+	return my_isalnum(system_charset_info,c)||c=='_'||c=='$'||(uchar) c>=0x80;
+}
+
+/* end of the token at pos: a quoted string or name, a word, or one character */
+static const char *token_end(const char *pos)
+{
+	char quote=*pos;
+	if(quote=='\''||quote=='"'||quote=='`')
+	{
+		for(pos++;*pos;pos++)
+		{
+			if(*pos=='\\'&&quote!='`'&&pos[1])
+				pos++;
+			else if(*pos==quote)
+			{
+				if(pos[1]!=quote)
+					return pos+1;
+				pos++;
+			}
+		}
+		return pos;
+	}
+	if(is_ident_char(quote))
+	{
+		while(is_ident_char(*pos))
+			pos++;
+		return pos;
+	}
+	return *pos?pos+1:pos;
+}
+
+static bool is_number(const char *start,const char *end)
+{
+	if(start==end)
+		return false;
+	for(;start<end;start++)
+	{
+		if(!my_isdigit(system_charset_info,*start))
+			return false;
+	}
+	return true;
+}
+
+static bool token_is(const char *start,const char *end,const char *word)
+{
+	uint length=(uint) strlen(word);
+	return (uint)(end-start)==length&&!my_strnncoll(system_charset_info,
+		(const uchar *)start,length,(const uchar *)word,length);
+}
+
+/* the column name as written, without its quotes, equals field */
+static bool token_is_field(const char *start,const char *end,const char *field)
+{
+	if(*start=='`'&&end-start>=2)
+	{
+		start++;
+		end--;
+	}
+	return token_is(start,end,field);
+}
+
+/* the last tokens read, most recent first */
+#define MYDB_TOKEN_HISTORY 4
+
+/*
+  Whether the column token preceded by history names the column of the
+  routing table: unqualified, or qualified by its alias and optionally
+  its schema. *qualified tells which.
+*/
+static bool column_of_table(SQL_SPAN *history,mydb_schema_table *route_table,
+	bool *qualified)
+{
+	*qualified=false;
+	if(!history[0].start||history[0].end-history[0].start!=1||*history[0].start!='.')
+		return true;
+	*qualified=true;
+	if(!history[1].start||!token_is_field(history[1].start,history[1].end,route_table->table_alias))
+		return false;
+	if(!history[2].start||history[2].end-history[2].start!=1||*history[2].start!='.')
+		return true;
+	return !route_table->is_alias_used&&history[3].start&&
+		token_is_field(history[3].start,history[3].end,route_table->schema_name);
+}
+
+/*
+  Find "field IN (...)" in query, or "field BETWEEN min AND max" for a
+  range, on the column of route_table, with the elements of the list or
+  the two bounds in elements. span covers what is rewritten per shard:
+  the parenthesized list, or min up to max. Fails unless the predicate
+  occurs exactly once, so a rewrite never touches a predicate routing
+  did not see; an unqualified column is ambiguous when the statement has
+  a subquery or a union, as it may name another table there.
+*/
+static bool find_route_predicate(const char *query,const char *field,
+	mydb_schema_table *route_table,bool range,SQL_SPAN *span,DYNAMIC_ARRAY *elements)
+{
+	const char *pos=query,*start,*end;
+	SQL_SPAN history[MYDB_TOKEN_HISTORY];
+	uint found=0,selects=0;
+	bool qualified,unqualified=false;
+	bzero(history,sizeof(history));
+	for(pos=skip_space(pos);*pos;pos=skip_space(end))
+	{
+		start=pos;
+		end=token_end(pos);
+		if(token_is(start,end,"select"))
+			selects++;
+		bool column=token_is_field(start,end,field)&&
+			column_of_table(history,route_table,&qualified);
+		memmove(history+1,history,(MYDB_TOKEN_HISTORY-1)*sizeof(SQL_SPAN));
+		history[0].start=start;
+		history[0].end=end;
+		if(!column)
+			continue;
+		const char *keyword=skip_space(end);
+		const char *keyword_end=token_end(keyword);
+		if(!token_is(keyword,keyword_end,range?"between":"in"))
+			continue;
+		if(++found>1)
+			return false;
+		unqualified=!qualified;
+		reset_dynamic(elements);
+		if(range)
+		{
+			/* min and max must each be one literal, with an optional sign */
+			SQL_SPAN bound;
+			pos=keyword_end;
+			for(uint idx=0;idx<2;idx++)
+			{
+				bound.start=pos=skip_space(pos);
+				if(*pos=='-'||*pos=='+')
+					pos=skip_space(pos+1);
+				bound.end=pos=token_end(pos);
+				if(bound.end==bound.start||insert_dynamic(elements,(uchar *)&bound))
+					return false;
+				if(!idx)
+				{
+					const char *and_start=skip_space(pos);
+					pos=token_end(and_start);
+					if(!token_is(and_start,pos,"and"))
+						return false;
+				}
+			}
+			span->start=((SQL_SPAN *)dynamic_array_ptr(elements,0))->start;
+			span->end=bound.end;
+			end=pos;
+			history[0].start=history[0].end=NULL;
+			continue;
+		}
+		SQL_SPAN element;
+		uint depth=0;
+		pos=skip_space(keyword_end);
+		if(*pos!='(')
+			return false;
+		span->start=pos;
+		element.start=pos+1;
+		for(;*pos;pos=skip_space(token_end(pos)))
+		{
+			if(*pos=='(')
+				depth++;
+			else if(*pos==')'||(*pos==','&&depth==1))
+			{
+				element.end=pos;
+				if(*pos==','||!--depth)
+				{
+					if(insert_dynamic(elements,(uchar *)&element))
+						return false;
+					element.start=pos+1;
+				}
+				if(!depth)
+					break;
+			}
+		}
+		if(*pos!=')')
+			return false;
+		span->end=end=pos+1;
+		history[0].start=history[0].end=NULL;
+	}
+	return found==1&&!(unqualified&&selects>1);
+}
+
+/* the value a list element stands for: a literal without its quotes */
+static void element_value(SQL_SPAN *element,String *value)
+{
+	const char *pos=skip_space(element->start),*end=element->end;
+	char quote;
+	while(end>pos&&my_isspace(system_charset_info,end[-1]))
+		end--;
+	value->length(0);
+	quote=*pos;
+	if(quote!='\''&&quote!='"')
+	{
+		value->append(pos,(uint32)(end-pos));
+		return;
+	}
+	for(pos++;pos<end;pos++)
+	{
+		if(*pos=='\\'&&pos+1<end)
+			pos++;
+		else if(*pos==quote)
+		{
+			if(pos+1<end&&pos[1]==quote)
+				pos++;
+			else
+				break;
+		}
+		value->append(*pos);
+	}
+}
+
+static uchar* shard_key_get_key(SHARD_KEY *key, size_t *length,
+                             my_bool not_used __attribute__((unused)))
+{
+	*length=strlen(key->value);
+	return (uchar*) key->value;
+}
+
+/*
+  The column of the routing predicate that shards could be pruned by,
+  NULL when there is none, it is no IN or BETWEEN, or the shards were not
+  chosen value by value.
+*/
+const char *list_sql_tree::_route_field()
+{
+	const char *field;
+	if(!route_cond||!route_keys.usable||!shard_info.elements||!route_keys.keys.elements)
+		return NULL;
+	if(route_cond->op!=(route_cond->isRange?Item_func::BETWEEN:Item_func::IN_FUNC))
+		return NULL;
+	field=route_cond->field_name->f_name;
+	if(strrchr(field,'.'))
+		field=strrchr(field,'.')+1;
+	return field;
+}
+
+/*
+  What replaces the routing predicate, with the given elements, in the
+  statement of every shard: the IN list cut down to the values the shard
+  was chosen for, or the BETWEEN bounds clipped to the part of the range
+  it holds. A list element that is not one of the routed values stays in
+  every list. NULL, or an empty part, means the original text.
+*/
+String *list_sql_tree::_prune_parts(DYNAMIC_ARRAY *elements)
+{
+	HASH values;
+	bool done=false;
+	String *parts=NULL,value;
+	uint count=shard_info.elements,idx;
+	if(!(parts=new String[count]))
+		return NULL;
+	if(route_cond->isRange)
+	{
+		/* the smallest range holding every interval a shard was chosen for */
+		SHARD_KEY **ranges=(SHARD_KEY **)my_malloc(count*sizeof(SHARD_KEY *),MYF(MY_WME|MY_ZEROFILL));
+		if(!ranges)
+			goto end;
+		for(idx=0;idx<route_keys.keys.elements;idx++)
+		{
+			SHARD_KEY *key=(SHARD_KEY *)dynamic_array_ptr(&route_keys.keys,idx);
+			if(key->value||key->shard>=count)
+				continue;
+			if(!ranges[key->shard])
+				ranges[key->shard]=key;
+			else
+			{
+				ranges[key->shard]->min=MY_MIN(ranges[key->shard]->min,key->min);
+				ranges[key->shard]->max=MY_MAX(ranges[key->shard]->max,key->max);
+			}
+		}
+		for(idx=0;idx<count;idx++)
+		{
+			if(!ranges[idx])
+				continue;
+			parts[idx].append_longlong(ranges[idx]->min);
+			parts[idx].append(STRING_WITH_LEN(" and "));
+			parts[idx].append_longlong(ranges[idx]->max);
+		}
+		my_free(ranges);
+	}
+	else
+	{
+		if(my_hash_init(&values,&my_charset_bin,route_keys.keys.elements,0,0,
+			(my_hash_get_key) shard_key_get_key,0,0))
+			goto end;
+		for(idx=0;idx<route_keys.keys.elements;idx++)
+		{
+			SHARD_KEY *key=(SHARD_KEY *)dynamic_array_ptr(&route_keys.keys,idx);
+			if(key->value)
+				(void) my_hash_insert(&values,(uchar *)key);
+		}
+		for(idx=0;idx<elements->elements;idx++)
+		{
+			SQL_SPAN *element=(SQL_SPAN *)dynamic_array_ptr(elements,idx);
+			HASH_SEARCH_STATE state;
+			SHARD_KEY *key;
+			element_value(element,&value);
+			key=(SHARD_KEY *)my_hash_first(&values,(uchar *)value.ptr(),value.length(),&state);
+			for(uint shard=0;!key&&shard<count;shard++)
+			{
+				parts[shard].append(parts[shard].length()?',':'(');
+				parts[shard].append(element->start,(uint32)(element->end-element->start));
+			}
+			for(;key;key=(SHARD_KEY *)my_hash_next(&values,(uchar *)value.ptr(),value.length(),&state))
+			{
+				String *part;
+				if(key->shard>=count)
+					continue;
+				part=&parts[key->shard];
+				part->append(part->length()?',':'(');
+				part->append(element->start,(uint32)(element->end-element->start));
+			}
+		}
+		my_hash_free(&values);
+		for(idx=0;idx<count;idx++)
+		{
+			if(parts[idx].length())
+				parts[idx].append(')');
+		}
+	}
+	done=true;
+end:
+	if(!done)
+	{
+		delete [] parts;
+		parts=NULL;
+	}
+	return parts;
+}
+
+/* words after which a table name comes */
+static const char *from_words[]={"from","join","straight_join","update",NullS};
+/* words that end a FROM clause */
+static const char *clause_words[]={"select","on","using","where","group","having",
+	"order","limit","union","procedure","into","for","lock","window","set",NullS};
+/* options between SELECT and its select list */
+static const char *select_options[]={"all","distinct","distinctrow","high_priority",
+	"straight_join","sql_small_result","sql_big_result","sql_buffer_result",
+	"sql_cache","sql_no_cache","sql_calc_found_rows",NullS};
+/*
+  clauses of the outermost SELECT that may refer to its select list; a
+  GROUP BY list is marked to be replaced along with it
+*/
+static const char *select_list_words[]={"having","order","union","into",
+	"procedure","window",NullS};
+/* words that end a GROUP BY list */
+static const char *group_end_words[]={"with","having","order","limit","procedure",
+	"into","for","lock","window","union",NullS};
+/* words that may follow a table name and are not its alias */
+static const char *join_words[]={"inner","left","right","cross","natural","outer",
+	"full","use","ignore","force","partition",NullS};
+
+static bool token_in(const char *start,const char *end,const char **words)
+{
+	if(*start=='`')
+		return false;
+	for(;*words;words++)
+	{
+		if(token_is(start,end,*words))
+			return true;
+	}
+	return false;
+}
+
+static bool is_name(const char *start)
+{
+	return *start=='`'||is_ident_char(*start);
+}
+
+/* the name a token stands for, without its quotes */
+static void token_name(const char *start,const char *end,String *name)
+{
+	name->length(0);
+	if(*start!='`')
+	{
+		name->append(start,(uint32)(end-start));
+		return;
+	}
+	for(start++,end--;start<end;start++)
+	{
+		if(*start=='`'&&start+1<end&&start[1]=='`')
+			start++;
+		name->append(*start);
+	}
+}
+
+/* the sharded table of the table list named db.name, or name in current_db */
+static mydb_schema_table *find_table(List<mydb_schema_table> *tables,shard_table_map *map,
+	const char *current_db,String *db,String *name)
+{
+	List_iterator<mydb_schema_table> li(*tables);
+	mydb_schema_table *mst;
+	const char *schema=db?db->c_ptr_safe():current_db;
+	if(!map)
+		return NULL;
+	while((mst=li++))
+	{
+		if(!my_strcasecmp(table_alias_charset,mst->table_name,name->c_ptr_safe())&&
+			(!schema||!my_strcasecmp(table_alias_charset,mst->schema_name,schema))&&
+			map->table_in_list(mst->table_name))
+			return mst;
+	}
+	return NULL;
+}
+
+int sql_template::add(enum sql_piece_type type,const char *start,uint length,bool alias,
+	bool top)
+{
+	SQL_PIECE piece;
+	if(type==SQL_PIECE_TEXT&&!length)
+		return 0;
+	piece.type=type;
+	piece.start=start;
+	piece.length=length;
+	piece.alias=alias;
+	piece.top=top;
+	return insert_dynamic(&pieces,(uchar *)&piece);
+}
+
+/*
+  Cut query into pieces. A name is a table reference where FROM, JOIN,
+  or a comma in a FROM clause puts one, tracked per parenthesis level;
+  it becomes a table piece when it names a sharded table of tables.
+  db.table.column loses its db, the shard's table being elsewhere.
+  route, when given, is the routing predicate found in query. The select
+  list of a SELECT is marked when nothing else in the statement can
+  refer to it, so that it may be replaced by the columns read, and so is
+  its GROUP BY list, which may refer to it by name or position.
+*/
+int sql_template::build(const char *query,List<mydb_schema_table> *tables,
+	shard_table_map *map,const char *current_db,SQL_SPAN *route)
+{
+	struct{bool from,expect;} state[MYDB_SQL_MAX_DEPTH];
+	const char *text=query,*pos,*start,*end;
+	String db,name;
+	mydb_schema_table *mst;
+	const char *columns=NULL;
+	bool listing=false,grouping=false,projectable=false;
+	uint depth=0,marks=0,groups=0;
+	reset_dynamic(&pieces);
+	state[0].from=state[0].expect=false;
+	pos=skip_space(query);
+	if(token_is(pos,token_end(pos),"select"))
+	{
+		for(columns=skip_space(token_end(pos));
+			token_in(columns,token_end(columns),select_options);
+			columns=skip_space(token_end(columns)))
+			;
+		projectable=true;
+	}
+	for(;*pos;pos=skip_space(end))
+	{
+		start=pos;
+		end=token_end(pos);
+		if(route&&start==route->start)
+		{
+			if(add(SQL_PIECE_TEXT,text,(uint)(start-text),false)||
+				add(SQL_PIECE_ROUTE,start,(uint)(route->end-start),false))
+				return 1;
+			text=end=route->end;
+			continue;
+		}
+		if(columns&&start<columns)
+			continue;
+		if(start==columns)
+		{
+			if(add(SQL_PIECE_TEXT,text,(uint)(start-text),false)||
+				add(SQL_PIECE_COLUMNS,start,0,false))
+				return 1;
+			text=start;
+			listing=true;
+			marks++;
+		}
+		if(*start=='(')
+		{
+			state[MY_MIN(depth,MYDB_SQL_MAX_DEPTH-1)].expect=false;
+			if(++depth<MYDB_SQL_MAX_DEPTH)
+			{
+				/* a table, or a join of them, may open a FROM clause */
+				state[depth].from=state[depth-1].from;
+				state[depth].expect=state[depth].from;
+			}
+			continue;
+		}
+		if(*start==')')
+		{
+			if(depth)
+				depth--;
+			continue;
+		}
+		uint level=MY_MIN(depth,MYDB_SQL_MAX_DEPTH-1);
+		if(*start==',')
+		{
+			state[level].expect=state[level].from;
+			continue;
+		}
+		if(!is_name(start))
+		{
+			state[level].expect=false;
+			continue;
+		}
+		if(!depth&&listing&&token_is(start,end,"from"))
+		{
+			if(add(SQL_PIECE_TEXT,text,(uint)(start-text),false)||
+				add(SQL_PIECE_COLUMNS_END,start,0,false))
+				return 1;
+			text=start;
+			listing=false;
+			marks++;
+		}
+		if(!depth&&grouping&&token_in(start,end,group_end_words))
+		{
+			if(add(SQL_PIECE_TEXT,text,(uint)(start-text),false)||
+				add(SQL_PIECE_GROUP_END,start,0,false))
+				return 1;
+			text=start;
+			grouping=false;
+			groups++;
+		}
+		if(!depth&&!listing&&token_is(start,end,"group"))
+		{
+			const char *by=skip_space(end),*by_end=token_end(by);
+			if(token_is(by,by_end,"by"))
+			{
+				const char *list=skip_space(by_end);
+				if(add(SQL_PIECE_TEXT,text,(uint)(list-text),false)||
+					add(SQL_PIECE_GROUP,list,0,false))
+					return 1;
+				text=list;
+				grouping=true;
+				groups++;
+				state[level].from=state[level].expect=false;
+				end=by_end;
+				continue;
+			}
+		}
+		if(!depth&&token_in(start,end,select_list_words))
+			projectable=false;
+		if(!depth&&token_is(start,end,"limit"))
+		{
+			/*
+			  LIMIT offset,count or LIMIT count OFFSET offset: a shard
+			  cannot know which rows the others skip and sends them all
+			*/
+			const char *count=skip_space(end),*count_end=token_end(count);
+			const char *next=skip_space(count_end),*next_end=token_end(next);
+			const char *offset=skip_space(next_end),*offset_end=token_end(offset);
+			if(is_number(count,count_end)&&(*next==','||token_is(next,next_end,"offset"))&&
+				is_number(offset,offset_end))
+			{
+				if(add(SQL_PIECE_TEXT,text,(uint)(count-text),false)||
+					add(SQL_PIECE_LIMIT,count,(uint)(offset_end-count),false))
+					return 1;
+				text=end=offset_end;
+				continue;
+			}
+		}
+		if(token_in(start,end,from_words))
+		{
+			state[level].from=state[level].expect=true;
+			continue;
+		}
+		if(token_in(start,end,clause_words))
+		{
+			state[level].from=state[level].expect=false;
+			continue;
+		}
+		const char *dot=skip_space(end),*table=start,*table_end=end;
+		if(*dot=='.')
+		{
+			table=skip_space(dot+1);
+			table_end=token_end(table);
+		}
+		if(!state[level].expect)
+		{
+			/* a column: only db.table.column needs a change */
+			if(table!=start&&is_name(table)&&*skip_space(table_end)=='.')
+			{
+				token_name(start,end,&db);
+				token_name(table,table_end,&name);
+				if(find_table(tables,map,current_db,&db,&name))
+				{
+					if(add(SQL_PIECE_TEXT,text,(uint)(start-text),false))
+						return 1;
+					text=table;
+				}
+			}
+			end=table_end;
+			continue;
+		}
+		state[level].expect=false;
+		if(!is_name(table))
+			continue;
+		if(table!=start)
+			token_name(start,end,&db);
+		token_name(table,table_end,&name);
+		end=table_end;
+		if(!(mst=find_table(tables,map,current_db,table!=start?&db:NULL,&name)))
+			continue;
+		const char *next=skip_space(end),*next_end=token_end(next);
+		bool aliased=is_name(next)&&!token_in(next,next_end,from_words)&&
+			!token_in(next,next_end,clause_words)&&!token_in(next,next_end,join_words);
+		if(add(SQL_PIECE_TEXT,text,(uint)(start-text),false)||
+			add(SQL_PIECE_TABLE,mst->table_name,(uint)strlen(mst->table_name),!aliased,!depth))
+			return 1;
+		text=end;
+	}
+	if(add(SQL_PIECE_TEXT,text,(uint)strlen(text),false)||
+		(grouping&&add(SQL_PIECE_GROUP_END,text+strlen(text),0,false)))
+		return 1;
+	if(grouping)
+		groups++;
+	bool marked=projectable&&marks==2&&(!groups||groups==2);
+	for(uint idx=pieces.elements;(marks||groups)&&!marked&&idx--;)
+	{
+		SQL_PIECE *piece=(SQL_PIECE *)dynamic_array_ptr(&pieces,idx);
+		if(piece->type==SQL_PIECE_COLUMNS||piece->type==SQL_PIECE_COLUMNS_END||
+			piece->type==SQL_PIECE_GROUP||piece->type==SQL_PIECE_GROUP_END)
+			delete_dynamic_element(&pieces,idx);
+	}
+	return 0;
+}
+
+/* the select list is marked and table_name is a table of its FROM clause */
+bool sql_template::projects(const char *table_name)
+{
+	bool marked=false,found=false;
+	for(uint idx=0;idx<pieces.elements;idx++)
+	{
+		SQL_PIECE *piece=(SQL_PIECE *)dynamic_array_ptr(&pieces,idx);
+		if(piece->type==SQL_PIECE_COLUMNS)
+			marked=true;
+		else if(piece->type==SQL_PIECE_TABLE&&piece->top&&
+			!my_strcasecmp(table_alias_charset,piece->start,table_name))
+			found=true;
+	}
+	return marked&&found;
+}
+
+/* `prefixname`, with backquotes doubled */
+static bool append_name(String *sql,const char *prefix,const char *name)
+{
+	bool error=sql->append('`');
+	for(const char *pos=prefix;pos&&*pos;pos++)
+		error|=(*pos=='`'&&sql->append('`'))|sql->append(*pos);
+	for(const char *pos=name;pos&&*pos;pos++)
+		error|=(*pos=='`'&&sql->append('`'))|sql->append(*pos);
+	return error|sql->append('`');
+}
+
+/* offset+count, the rows each shard sends, for the two numbers of a LIMIT piece */
+static bool append_limit(String *sql,const char *start)
+{
+	const char *second=skip_space(token_end(skip_space(token_end(start))));
+	int error;
+	ulonglong first=(ulonglong) my_strtoll10(start,NULL,&error);
+	ulonglong rows=first+(ulonglong) my_strtoll10(second,NULL,&error);
+	if(rows<first)
+		rows=~(ulonglong)0;
+	return sql->append_ulonglong(rows);
+}
+
+/*
+  The statement of shard into sql: its schema and table prefix on every
+  table piece, route, if not empty, for the routing predicate, columns,
+  if given, for the select list and group, if given, for the GROUP BY
+  list.
+*/
+int sql_template::render(String *sql,CONNECT_PARAM *shard,String *route,String *columns,
+	String *group)
+{
+	bool error=false;
+	sql->length(0);
+	for(uint idx=0;idx<pieces.elements;idx++)
+	{
+		SQL_PIECE *piece=(SQL_PIECE *)dynamic_array_ptr(&pieces,idx);
+		switch(piece->type)
+		{
+		case SQL_PIECE_TABLE:
+			error|=append_name(sql,NULL,shard->schema)|sql->append('.')|
+				append_name(sql,shard->table_name,piece->start);
+			if(piece->alias)
+				error|=sql->append(STRING_WITH_LEN(" AS "))|append_name(sql,NULL,piece->start);
+			break;
+		case SQL_PIECE_COLUMNS:
+		case SQL_PIECE_GROUP:
+		{
+			String *list=piece->type==SQL_PIECE_COLUMNS?columns:group;
+			enum sql_piece_type end=piece->type==SQL_PIECE_COLUMNS?
+				SQL_PIECE_COLUMNS_END:SQL_PIECE_GROUP_END;
+			if(!list)
+				break;
+			error|=sql->append(*list)|sql->append(' ');
+			while(++idx<pieces.elements&&((SQL_PIECE *)dynamic_array_ptr(&pieces,idx))->type!=end)
+				;
+			break;
+		}
+		case SQL_PIECE_LIMIT:
+			error|=append_limit(sql,piece->start);
+			break;
+		case SQL_PIECE_ROUTE:
+			if(route&&route->length())
+			{
+				error|=sql->append(*route);
+				break;
+			}
+			/* fall through */
+		default:
+			error|=sql->append(piece->start,piece->length);
+		}
+	}
+	return error;
+}
+
+static bool is_literal(const char *start,const char *end)
+{
+	return *start=='\''||*start=='"'||is_number(start,end);
+}
+
+int sql_digest::build(const char *statement,const char *db)
+{
+	const char *copied=statement,*pos,*end;
+	bool error=false;
+	query=statement;
+	reset_dynamic(&literals);
+	text.length(0);
+	if(db)
+		error|=text.append(db);
+	error|=text.append('\0');
+	prefix=text.length();
+	for(pos=skip_space(query);*pos;pos=skip_space(end))
+	{
+		SQL_SPAN literal;
+		end=token_end(pos);
+		if(!is_literal(pos,end))
+			continue;
+		literal.start=pos;
+		literal.end=end;
+		error|=text.append(copied,(uint32)(pos-copied))|text.append('?')|
+			insert_dynamic(&literals,(uchar *)&literal);
+		copied=end;
+	}
+	error|=text.append(copied,(uint32)strlen(copied));
+	rewind();
+	return error;
+}
+
+/* the position in query of offset in the shape */
+const char *sql_digest::position(uint offset)
+{
+	for(;cursor<literals.elements;cursor++)
+	{
+		SQL_SPAN *literal=(SQL_SPAN *)dynamic_array_ptr(&literals,cursor);
+		if((size_t)(literal->start-query)-shift+1>offset)
+			break;
+		shift+=(literal->end-literal->start)-1;
+	}
+	return query+offset+shift;
+}
+
+/* the offset in the shape of pos, a position in query between tokens */
+uint sql_digest::offset(const char *pos)
+{
+	for(;cursor<literals.elements;cursor++)
+	{
+		SQL_SPAN *literal=(SQL_SPAN *)dynamic_array_ptr(&literals,cursor);
+		if(literal->end>pos)
+			break;
+		shift+=(literal->end-literal->start)-1;
+	}
+	return (uint)((pos-query)-shift);
+}
+
+/*
+  The fields of table the server reads as the select list of the shard
+  statements, each qualified by the name the statement gives the table,
+  and their positions in projection for the conversion of rows.
+*/
+int list_sql_tree::_make_projection(TABLE *table,String *columns)
+{
+	Field **field;
+	bool error=false;
+	uint count=0;
+	if(!(projection=(uint *)alloc_root(&mem_root,MY_MAX(table->s->fields,1)*sizeof(uint))))
+		return 1;
+	columns->length(0);
+	for(field=table->field;*field;field++)
+	{
+		if(!bitmap_is_set(table->read_set,(*field)->field_index))
+			continue;
+		if(count)
+			error|=columns->append(',');
+		error|=append_name(columns,NULL,table->alias)|columns->append('.')|
+			append_name(columns,NULL,(*field)->field_name);
+		projection[count++]=(*field)->field_index;
+	}
+	/* no field read, as for COUNT(*): the rows still have to come back */
+	if(!count)
+		error|=columns->append('1');
+	projection_count=count;
+	projected=!error;
+	return error;
+}
+
+/* the SUM of field can be spread back over rows of the field exactly */
+static bool summable(Field *field)
+{
+	switch(field->type())
+	{
+	case MYSQL_TYPE_TINY:
+	case MYSQL_TYPE_SHORT:
+	case MYSQL_TYPE_INT24:
+	case MYSQL_TYPE_LONG:
+	case MYSQL_TYPE_LONGLONG:
+	case MYSQL_TYPE_NEWDECIMAL:
+	case MYSQL_TYPE_DOUBLE:
+		return true;
+	default:
+		return false;
+	}
+}
+
+/* `alias`.`name` of field */
+static bool append_field(String *sql,TABLE *table,Field *field)
+{
+	return append_name(sql,NULL,table->alias)|sql->append('.')|
+		append_name(sql,NULL,field->field_name);
+}
+
+/* field is one of the GROUP BY fields */
+static bool grouped(SELECT_LEX *select_lex,Field *field)
+{
+	for(ORDER *order=select_lex->group_list.first;order;order=order->next)
+	{
+		Item *item=(*order->item)->real_item();
+		if(item->type()==Item::FIELD_ITEM&&((Item_field *)item)->field==field)
+			return true;
+	}
+	return false;
+}
+
+/*
+  The select list of partial aggregates for an outermost SELECT of
+  COUNT, SUM, AVG, MIN and MAX over fields of table only: COUNT(*), then
+  per aggregated field its COUNT and its SUM, AVG being SUM/COUNT, or
+  its MIN and MAX. The GROUP BY fields come bare, the shards grouping by
+  them in group, which makes a shard send a row per group and the
+  server merge the groups of all shards. Every other field sampled, as
+  the bare fields of the select list and the one the WHERE clause may
+  read besides them, is sent as its MIN(): a value of one of the
+  matching rows, so that the rows the scan rebuilds from the partials
+  still satisfy the WHERE clause, and which backends running with
+  ONLY_FULL_GROUP_BY accept. A WHERE clause reading more such fields
+  could not be satisfied from values of different rows, and a field
+  both aggregated and filtered on cannot be rebuilt. Returns -1 when
+  the statement does not qualify, 1 on error.
+*/
+int list_sql_tree::_make_aggregation(TABLE *table,String *columns,String *group)
+{
+	SELECT_LEX *select_lex=&list_thd->lex->select_lex;
+	List_iterator<Item> li(select_lex->item_list);
+	List<Item_field> where_fields;
+	Item *item,*where=select_lex->where;
+	Item_field *item_field;
+	ORDER *order;
+	Field **field;
+	bool error=false;
+	uint width=1;
+	if(list_thd->lex->sql_command!=SQLCOM_SELECT||
+		(!select_lex->with_sum_func&&!select_lex->group_list.elements)||select_lex->olap!=UNSPECIFIED_OLAP_TYPE||select_lex->having||select_lex->next_select()||
+		(select_lex->options&SELECT_DISTINCT)||select_lex->table_list.elements!=1||
+		!table->pos_in_table_list||table->pos_in_table_list->select_lex!=select_lex||
+		(where&&(where->used_tables()&~table->map)))
+		return -1;
+	if(!(aggregates=(AGG_COLUMN *)alloc_root(&mem_root,MY_MAX(table->s->fields,1)*sizeof(AGG_COLUMN))))
+		return 1;
+	bzero(aggregates,MY_MAX(table->s->fields,1)*sizeof(AGG_COLUMN));
+	counted=false;
+	group->length(0);
+	for(order=select_lex->group_list.first;order;order=order->next)
+	{
+		item=(*order->item)->real_item();
+		if(item->type()!=Item::FIELD_ITEM||((Item_field *)item)->field->table!=table)
+			return -1;
+		aggregates[((Item_field *)item)->field->field_index].kind=AGG_SAMPLE;
+		if(group->length())
+			error|=group->append(',');
+		error|=append_field(group,table,((Item_field *)item)->field);
+	}
+	while((item=li++))
+	{
+		enum agg_column_kind kind;
+		AGG_COLUMN *column;
+		Item *arg;
+		if(item->basic_const_item())
+			continue;
+		/* a bare field takes its value from a matching row, as on the server */
+		if(item->real_item()->type()==Item::FIELD_ITEM&&
+			((Item_field *)item->real_item())->field->table==table)
+		{
+			column=&aggregates[((Item_field *)item->real_item())->field->field_index];
+			if(column->kind!=AGG_NONE&&column->kind!=AGG_SAMPLE)
+				return -1;
+			column->kind=AGG_SAMPLE;
+			continue;
+		}
+		if(item->type()!=Item::SUM_FUNC_ITEM||((Item_sum *)item)->get_arg_count()!=1)
+			return -1;
+		arg=((Item_sum *)item)->get_arg(0)->real_item();
+		switch(((Item_sum *)item)->sum_func())
+		{
+		case Item_sum::COUNT_FUNC:
+			counted=true;
+			/* COUNT(*) */
+			if(arg->const_item()&&!arg->is_null())
+				continue;
+			kind=AGG_COUNT;
+			break;
+		case Item_sum::AVG_FUNC:
+			counted=true;
+			/* fall through */
+		case Item_sum::SUM_FUNC:
+			kind=AGG_SUM;
+			break;
+		case Item_sum::MIN_FUNC:
+		case Item_sum::MAX_FUNC:
+			kind=AGG_RANGE;
+			break;
+		default:
+			return -1;
+		}
+		if(arg->type()!=Item::FIELD_ITEM||((Item_field *)arg)->field->table!=table||
+			(kind==AGG_SUM&&!summable(((Item_field *)arg)->field)))
+			return -1;
+		column=&aggregates[((Item_field *)arg)->field->field_index];
+		if(column->kind==AGG_SAMPLE)
+			return -1;
+		if(column->kind==AGG_NONE||column->kind==AGG_COUNT)
+			column->kind=kind;
+		else if(kind!=AGG_COUNT&&kind!=column->kind)
+			return -1;
+	}
+	if(where)
+	{
+		Field *filtered=NULL;
+		where->walk(&Item::collect_item_field_processor,0,(uchar *)&where_fields);
+		List_iterator<Item_field> wi(where_fields);
+		while((item_field=wi++))
+		{
+			AGG_COLUMN *column=&aggregates[item_field->field->field_index];
+			if(column->kind!=AGG_NONE&&column->kind!=AGG_SAMPLE)
+				return -1;
+			if(!grouped(select_lex,item_field->field))
+			{
+				if(filtered&&filtered!=item_field->field)
+					return -1;
+				filtered=item_field->field;
+			}
+			column->kind=AGG_SAMPLE;
+		}
+	}
+	columns->length(0);
+	error|=columns->append(STRING_WITH_LEN("COUNT(*)"));
+	for(field=table->field;*field;field++)
+	{
+		AGG_COLUMN *column=&aggregates[(*field)->field_index];
+		column->value=width;
+		switch(column->kind)
+		{
+		case AGG_NONE:
+			/* read for something the partials do not rebuild */
+			if(bitmap_is_set(table->read_set,(*field)->field_index))
+				return -1;
+			break;
+		case AGG_SUM:
+			error|=columns->append(STRING_WITH_LEN(",COUNT("))|append_field(columns,table,*field)|
+				columns->append(STRING_WITH_LEN("),SUM("))|append_field(columns,table,*field)|
+				columns->append(')');
+			width+=2;
+			break;
+		case AGG_COUNT:
+		case AGG_RANGE:
+			error|=columns->append(STRING_WITH_LEN(",COUNT("))|append_field(columns,table,*field)|
+				columns->append(STRING_WITH_LEN("),MIN("))|append_field(columns,table,*field)|
+				columns->append(STRING_WITH_LEN("),MAX("))|append_field(columns,table,*field)|
+				columns->append(')');
+			width+=3;
+			break;
+		case AGG_SAMPLE:
+			if(grouped(select_lex,*field))
+				error|=columns->append(',')|append_field(columns,table,*field);
+			else
+				error|=columns->append(STRING_WITH_LEN(",MIN("))|append_field(columns,table,*field)|
+					columns->append(')');
+			width++;
+			break;
+		}
+	}
+	aggregate_width=width;
+	aggregated=!error;
+	return error;
+}
+
+/*
+  One statement per shard from the template of the statement: the
+  sharded tables renamed to the shard's, the routing predicate cut down
+  to what the shard holds and, when table is read by the outermost
+  SELECT, its select list cut down to the fields read, or to partial
+  aggregates when the statement only aggregates table. The template, and
+  where the routing predicate is, come from the plan cache when a
+  statement of the same shape was seen with the same routing snapshot.
+*/
+int list_sql_tree::resetup_sql_command(shard_table_map *stm1,TABLE *table)
+{
+	SQL_SPAN span;
+	DYNAMIC_ARRAY elements;
+	sql_template shard_sql;
+	sql_digest digest;
+	String sql,columns,group,*parts=NULL;
+	List_iterator<CONNECT_PARAM> ui(shard_info);
+	CONNECT_PARAM *mcp;
+	const char *field=_route_field(),*route_name=NULL;
+	char name[NAME_LEN*2+2];
+	bool range=field&&route_cond->isRange;
+	ulonglong version=routing?routing->version:0;
+	int error=0,found=-1;
+	bool cached=pcache&&pcache->max_entries&&!digest.build(_query,list_thd->db);
+	if(my_init_dynamic_array(&elements,sizeof(SQL_SPAN),64,64))
+		return 1;
+	/* the cached predicate is of this table's column, a self-join has two */
+	if(field)
+	{
+		my_snprintf(name,sizeof(name),"%s.%s",route_cond->field_name->field_table.table_alias,field);
+		route_name=name;
+	}
+	sql_commands=(char **)alloc_root(&mem_root,(shard_info.elements+1)*sizeof(char *));
+	if(!sql_commands)
+		error=1;
+	else if(cached)
+		found=pcache->lookup(&digest,version,route_name,range,&tablelist,&shard_sql,&span,&elements);
+	if(!error&&found<0)
+	{
+		found=field&&find_route_predicate(_query,field,&route_cond->field_name->field_table,
+			range,&span,&elements);
+		if(shard_sql.build(_query,&tablelist,stm1,list_thd->db,found?&span:NULL))
+			error=1;
+		else if(cached)
+			pcache->insert(&digest,version,route_name,range,&shard_sql,found?&span:NULL,&elements);
+	}
+	if(!error&&found>0)
+		parts=_prune_parts(&elements);
+	projected=aggregated=false;
+	/* the rows of a GROUP BY can only be cut down to partial aggregates */
+	if(!error&&table&&shard_sql.projects(table->s->table_name.str)&&
+		(error=_make_aggregation(table,&columns,&group))<0)
+		error=list_thd->lex->select_lex.group_list.elements?0:_make_projection(table,&columns);
+	for(uint idx=0;!error&&(mcp=ui++);idx++)
+	{
+		if(shard_sql.render(&sql,mcp,parts?&parts[idx]:NULL,
+			projected||aggregated?&columns:NULL,aggregated&&group.length()?&group:NULL)||
+			!(sql_commands[idx]=strmake_root(&mem_root,sql.ptr(),sql.length())))
+			error=1;
+	}
+	if(error)
+		sql_commands=NULL;
+	else
+		sql_commands[shard_info.elements]=NULL;
+	delete [] parts;
+	delete_dynamic(&elements);
+	return error;
+}
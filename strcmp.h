@@ -40,5 +40,6 @@ static int mydb_strreplace(char *output,char *src,char *orgstr,char *newsstr)
 		tmpnew=p+strlen(orgstr);
 	}
 	strncat(output,tmpnew,strlen(tmpnew));
+	return 0;
 }
 